@@ -6,26 +6,214 @@
 using namespace Rcpp;
 
 // stata
-List stata(const char * filePath, const bool missing);
-RcppExport SEXP readstata13_stata(SEXP filePathSEXP, SEXP missingSEXP) {
+List stata(const char * filePath, const bool missing, const bool lazy, SEXP rows, SEXP key, SEXP filter, SEXP sample, const bool stats);
+RcppExport SEXP readstata13_stata(SEXP filePathSEXP, SEXP missingSEXP, SEXP lazySEXP, SEXP rowsSEXP, SEXP keySEXP, SEXP filterSEXP, SEXP sampleSEXP, SEXP statsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject __result;
     Rcpp::RNGScope __rngScope;
     Rcpp::traits::input_parameter< const char * >::type filePath(filePathSEXP);
     Rcpp::traits::input_parameter< const bool >::type missing(missingSEXP);
-    __result = Rcpp::wrap(stata(filePath, missing));
+    Rcpp::traits::input_parameter< const bool >::type lazy(lazySEXP);
+    Rcpp::traits::input_parameter< SEXP >::type rows(rowsSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type key(keySEXP);
+    Rcpp::traits::input_parameter< SEXP >::type filter(filterSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type sample(sampleSEXP);
+    Rcpp::traits::input_parameter< const bool >::type stats(statsSEXP);
+    __result = Rcpp::wrap(stata(filePath, missing, lazy, rows, key, filter, sample, stats));
+    return __result;
+END_RCPP
+}
+// stataArrow
+double stataArrow(const char * filePath, SEXP schema, SEXP array);
+RcppExport SEXP readstata13_stataArrow(SEXP filePathSEXP, SEXP schemaSEXP, SEXP arraySEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< const char * >::type filePath(filePathSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type schema(schemaSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type array(arraySEXP);
+    __result = Rcpp::wrap(stataArrow(filePath, schema, array));
+    return __result;
+END_RCPP
+}
+// stataProfile
+SEXP stataProfile();
+RcppExport SEXP readstata13_stataProfile() {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    __result = Rcpp::wrap(stataProfile());
+    return __result;
+END_RCPP
+}
+// stataFileId
+NumericVector stataFileId(const char * filePath);
+RcppExport SEXP readstata13_stataFileId(SEXP filePathSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< const char * >::type filePath(filePathSEXP);
+    __result = Rcpp::wrap(stataFileId(filePath));
+    return __result;
+END_RCPP
+}
+// stataSidecarWrite
+double stataSidecarWrite(const char * filePath, List dat, RawVector meta, NumericVector id);
+RcppExport SEXP readstata13_stataSidecarWrite(SEXP filePathSEXP, SEXP datSEXP, SEXP metaSEXP, SEXP idSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< const char * >::type filePath(filePathSEXP);
+    Rcpp::traits::input_parameter< List >::type dat(datSEXP);
+    Rcpp::traits::input_parameter< RawVector >::type meta(metaSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type id(idSEXP);
+    __result = Rcpp::wrap(stataSidecarWrite(filePath, dat, meta, id));
+    return __result;
+END_RCPP
+}
+// stataSidecarRead
+SEXP stataSidecarRead(const char * filePath, NumericVector id);
+RcppExport SEXP readstata13_stataSidecarRead(SEXP filePathSEXP, SEXP idSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< const char * >::type filePath(filePathSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type id(idSEXP);
+    __result = Rcpp::wrap(stataSidecarRead(filePath, id));
     return __result;
 END_RCPP
 }
 // stataWrite
-int stataWrite(const char * filePath, Rcpp::DataFrame dat);
-RcppExport SEXP readstata13_stataWrite(SEXP filePathSEXP, SEXP datSEXP) {
+int stataWrite(const char * filePath, Rcpp::DataFrame dat, const bool gzip);
+RcppExport SEXP readstata13_stataWrite(SEXP filePathSEXP, SEXP datSEXP, SEXP gzipSEXP) {
 BEGIN_RCPP
     Rcpp::RObject __result;
     Rcpp::RNGScope __rngScope;
     Rcpp::traits::input_parameter< const char * >::type filePath(filePathSEXP);
     Rcpp::traits::input_parameter< Rcpp::DataFrame >::type dat(datSEXP);
-    __result = Rcpp::wrap(stataWrite(filePath, dat));
+    Rcpp::traits::input_parameter< const bool >::type gzip(gzipSEXP);
+    __result = Rcpp::wrap(stataWrite(filePath, dat, gzip));
+    return __result;
+END_RCPP
+}
+// stataWriteRaw
+RawVector stataWriteRaw(Rcpp::DataFrame dat);
+RcppExport SEXP readstata13_stataWriteRaw(SEXP datSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< Rcpp::DataFrame >::type dat(datSEXP);
+    __result = Rcpp::wrap(stataWriteRaw(dat));
+    return __result;
+END_RCPP
+}
+// stataWriteOpen
+SEXP stataWriteOpen(const char * filePath, Rcpp::DataFrame dat);
+RcppExport SEXP readstata13_stataWriteOpen(SEXP filePathSEXP, SEXP datSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< const char * >::type filePath(filePathSEXP);
+    Rcpp::traits::input_parameter< Rcpp::DataFrame >::type dat(datSEXP);
+    __result = Rcpp::wrap(stataWriteOpen(filePath, dat));
+    return __result;
+END_RCPP
+}
+// stataWriteChunk
+double stataWriteChunk(SEXP writer, Rcpp::DataFrame dat);
+RcppExport SEXP readstata13_stataWriteChunk(SEXP writerSEXP, SEXP datSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type writer(writerSEXP);
+    Rcpp::traits::input_parameter< Rcpp::DataFrame >::type dat(datSEXP);
+    __result = Rcpp::wrap(stataWriteChunk(writer, dat));
+    return __result;
+END_RCPP
+}
+// stataWriteClose
+double stataWriteClose(SEXP writer, Rcpp::List labeltable);
+RcppExport SEXP readstata13_stataWriteClose(SEXP writerSEXP, SEXP labeltableSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type writer(writerSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type labeltable(labeltableSEXP);
+    __result = Rcpp::wrap(stataWriteClose(writer, labeltable));
+    return __result;
+END_RCPP
+}
+// stataSortOrder
+IntegerVector stataSortOrder(List keys, int version);
+RcppExport SEXP readstata13_stataSortOrder(SEXP keysSEXP, SEXP versionSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< List >::type keys(keysSEXP);
+    Rcpp::traits::input_parameter< int >::type version(versionSEXP);
+    __result = Rcpp::wrap(stataSortOrder(keys, version));
+    return __result;
+END_RCPP
+}
+// stataModify
+double stataModify(const char * filePath, List meta);
+RcppExport SEXP readstata13_stataModify(SEXP filePathSEXP, SEXP metaSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< const char * >::type filePath(filePathSEXP);
+    Rcpp::traits::input_parameter< List >::type meta(metaSEXP);
+    __result = Rcpp::wrap(stataModify(filePath, meta));
+    return __result;
+END_RCPP
+}
+// stataBcal
+List stataBcal(CharacterVector lines);
+RcppExport SEXP readstata13_stataBcal(SEXP linesSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< CharacterVector >::type lines(linesSEXP);
+    __result = Rcpp::wrap(stataBcal(lines));
+    return __result;
+END_RCPP
+}
+// stataBcalDate
+IntegerVector stataBcalDate(NumericVector x, IntegerVector days, int first);
+RcppExport SEXP readstata13_stataBcalDate(SEXP xSEXP, SEXP daysSEXP, SEXP firstSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< NumericVector >::type x(xSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type days(daysSEXP);
+    Rcpp::traits::input_parameter< int >::type first(firstSEXP);
+    __result = Rcpp::wrap(stataBcalDate(x, days, first));
+    return __result;
+END_RCPP
+}
+// stataBcalDay
+NumericVector stataBcalDay(NumericVector x, IntegerVector days, int first);
+RcppExport SEXP readstata13_stataBcalDay(SEXP xSEXP, SEXP daysSEXP, SEXP firstSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< NumericVector >::type x(xSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type days(daysSEXP);
+    Rcpp::traits::input_parameter< int >::type first(firstSEXP);
+    __result = Rcpp::wrap(stataBcalDay(x, days, first));
+    return __result;
+END_RCPP
+}
+// stataDiff
+List stataDiff(const char * oldPath, const char * newPath, CharacterVector key);
+RcppExport SEXP readstata13_stataDiff(SEXP oldPathSEXP, SEXP newPathSEXP, SEXP keySEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< const char * >::type oldPath(oldPathSEXP);
+    Rcpp::traits::input_parameter< const char * >::type newPath(newPathSEXP);
+    Rcpp::traits::input_parameter< CharacterVector >::type key(keySEXP);
+    __result = Rcpp::wrap(stataDiff(oldPath, newPath, key));
     return __result;
 END_RCPP
 }
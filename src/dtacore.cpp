@@ -0,0 +1,1157 @@
+/*
+ * Copyright (C) 2014-2015 Jan Marvin Garbuszus and Sebastian Jeworutzki
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "dtacore.h"
+
+/* Test for a little-endian machine */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define dtaNative "LSF"
+#else
+#define dtaNative "MSF"
+#endif
+
+template <typename T>
+static T dtaReadBin(FILE * file, bool swapit)
+{
+  T t = 0;
+  dtaProf.io(sizeof(t));
+  if (fread(&t, sizeof(t), 1, file) != 1)
+    throw std::range_error("num: a binary read error occurred");
+  if (swapit==0)
+    return(t);
+  else
+    return(swap_endian(t));
+}
+
+static void dtaReadString(FILE * file, std::string &str)
+{
+  dtaProf.io(str.size());
+  if (!str.empty() && fread(&str[0], str.size(), 1, file) != 1)
+    throw std::range_error("char: a binary read error occurred");
+}
+
+static void dtaFileSeek(FILE * file, uint64_t pos)
+{
+  dtaProf.seek();
+#ifdef _WIN32
+  int const err = _fseeki64(file, pos, SEEK_SET);
+#else
+  int const err = fseeko(file, pos, SEEK_SET);
+#endif
+  if (err != 0)
+    throw std::range_error("seek: unable to reach a position in the file");
+}
+
+static void dtaTest(FILE * file, const std::string &tag)
+{
+  std::string test(tag.size(), '\0');
+  dtaReadString(file, test);
+  if (tag.compare(test)!=0)
+    throw std::range_error("When attempting to read " + tag +
+                           ": Something went wrong!");
+}
+
+void dtaReadHeader(FILE * file, dtaHeader &h)
+{
+  /*
+  * check the first byte. continue if "<"
+  */
+
+  std::string fbit(1, '\0');
+  dtaReadString(file, fbit);
+  if (fbit.compare("<")!=0)
+    throw std::range_error("First byte: Not a version 13/14/15 dta-file.");
+
+  fseek(file, 18, SEEK_CUR);// stata_dta><header>
+  dtaTest(file, "<release>");
+
+  /*
+  * version is a 4 byte character e.g. "117"
+  */
+
+  std::string version(3, '\0');
+  dtaReadString(file, version);
+  h.release = atoi(version.c_str());
+
+  switch(h.release)
+  {
+  case 117:
+    h.nvarnameslen = 33;
+    h.nformatslen = 49;
+    h.nvalLabelslen = 33;
+    h.nvarLabelslen = 81;
+    h.chlen = 33;
+    h.lbllen = 33;
+    break;
+  case 118:
+  case 119:
+    h.nvarnameslen = 129;
+    h.nformatslen = 57;
+    h.nvalLabelslen = 129;
+    h.nvarLabelslen = 321;
+    h.chlen = 129;
+    h.lbllen = 129;
+    break;
+  default:
+  {
+    char msg[80];
+    sprintf(msg, "File version is %d.\nVersion: Not a version 13/14/15 dta-file",
+            h.release);
+    throw std::range_error(msg);
+  }
+  }
+
+  fseek(file, 10, SEEK_CUR); // </release>
+  dtaTest(file, "<byteorder>");
+
+  /*
+  * byteorder is a 4 byte character e.g. "LSF". MSF referes to big-memory data.
+  */
+
+  h.byteorder.assign(3, '\0');
+  dtaReadString(file, h.byteorder);
+  h.swapit = h.byteorder.compare(dtaNative) != 0;
+
+  fseek(file, 12, SEEK_CUR); // </byteorder>
+  dtaTest(file, "<K>");
+
+  // 119 stores K in 4 bytes for more than 32767 variables
+  if (h.release==119)
+    h.k = dtaReadBin<uint32_t>(file, h.swapit);
+  else
+    h.k = dtaReadBin<uint16_t>(file, h.swapit);
+
+  fseek(file, 4, SEEK_CUR); //</K>
+  dtaTest(file, "<N>");
+
+  if (h.release==117)
+    h.n = dtaReadBin<uint32_t>(file, h.swapit);
+  else
+    h.n = dtaReadBin<uint64_t>(file, h.swapit);
+
+  fseek(file, 4, SEEK_CUR); //</N>
+  dtaTest(file, "<label>");
+
+  /*
+  * A dataset may have a label e.g. "Written by R". It has up to 80 characters.
+  */
+
+  uint16_t ndlabel = 0;
+  if (h.release>=118)
+    ndlabel = dtaReadBin<uint16_t>(file, h.swapit);
+  else
+    ndlabel = dtaReadBin<uint8_t>(file, h.swapit);
+
+  h.datalabel.assign(ndlabel, '\0');
+  dtaReadString(file, h.datalabel);
+
+  fseek(file, 8, SEEK_CUR); //</label>
+  dtaTest(file, "<timestamp>");
+
+  /*
+  * A dataset may have a timestamp. Its length is 0 or 17.
+  */
+
+  uint8_t const ntimestamp = dtaReadBin<uint8_t>(file, h.swapit);
+  h.timestamp.assign(ntimestamp == 17 ? 17 : 0, '\0');
+  dtaReadString(file, h.timestamp);
+
+  fseek(file, 21, SEEK_CUR); //</timestamp></header>
+  dtaTest(file, "<map>");
+
+  /*
+  * byte positions of certain areas of the file
+  * 1.  <stata_data>
+  * 2.  <map>
+  * 3.  <variable_types>
+  * 4.  <varnames>
+  * 5.  <sortlist>
+  * 6.  <formats>
+  * 7.  <value_label_names>
+  * 8.  <variable_labels>
+  * 9.  <characteristics>
+  * 10. <data>
+  * 11. <strls>
+  * 12. <value_labels>
+  * 13. </stata_data>
+  * 14. end-of-file
+  */
+
+  for (int i=0; i <14; ++i)
+    h.map[i] = dtaReadBin<uint64_t>(file, h.swapit);
+
+  fseek(file, 6, SEEK_CUR); //</map>
+  dtaTest(file, "<variable_types>");
+
+  /*
+  * vartypes.
+  * 0-2045: strf (String: Max length 2045)
+  * 32768:  strL (long String: Max length 2 billion)
+  * 65526:  double
+  * 65527:  float
+  * 65528:  long
+  * 65529:  int
+  * 65530:  byte
+  */
+
+  h.vartype.resize(h.k);
+  h.coloff.resize(h.k);
+  h.rowlen = 0;
+  for (uint32_t i=0; i<h.k; ++i)
+  {
+    h.vartype[i] = dtaReadBin<uint16_t>(file, h.swapit);
+    h.coloff[i] = h.rowlen;
+    h.rowlen += dtaWidth(h.vartype[i]);
+  }
+  h.data = h.map[9] + 6; // <data>
+
+  fseek(file, 17, SEEK_CUR); //</variable_types>
+}
+
+/* Wide observations are decoded in column tiles: the bytes of neighbouring
+ * variables are gathered for all observations of a block, so decoding a
+ * variable reads a small tile instead of one cache line per observation.
+ * Blocks of wide observations hold at least dtaTileRows of them.
+ */
+static const uint64_t dtaTileWidth = 4096;        // observations wider are tiled
+static const uint64_t dtaTileBytes = 1 << 18;     // bytes of a tile
+static const uint64_t dtaTileRows = 64;
+
+void dtaDecoder::decode(const char * obs, uint64_t first, uint64_t m,
+                        dtaSink &sink)
+{
+  na.resize(m);
+
+  if (h.rowlen <= dtaTileWidth || m == 1)
+  {
+    for (uint32_t i=0; i<h.k; ++i)
+      decodeVar(i, obs + h.coloff[i], h.rowlen, first, m, sink);
+    return;
+  }
+
+  uint64_t const maxwidth = std::max<uint64_t>(dtaTileBytes / m, 256);
+
+  for (uint32_t from=0; from<h.k; )
+  {
+    // variables [from, to) are at most maxwidth bytes wide, but at least one
+    uint32_t to = from + 1;
+    while (to < h.k && h.coloff[to] + dtaWidth(h.vartype[to]) -
+           h.coloff[from] <= maxwidth)
+      ++to;
+    uint64_t const width = (to < h.k ? h.coloff[to] : h.rowlen) -
+      h.coloff[from];
+
+    // one cache line more than the tile keeps observations in distinct sets
+    uint64_t const stride = (width + 63) / 64 * 64 + 64;
+    tile.resize(m * stride);
+    for (uint64_t j=0; j<m; ++j)
+      memcpy(&tile[j * stride], obs + j * h.rowlen + h.coloff[from], width);
+
+    for (uint32_t i=from; i<to; ++i)
+      decodeVar(i, tile.data() + h.coloff[i] - h.coloff[from], stride, first,
+                m, sink);
+    from = to;
+  }
+}
+
+void dtaDecoder::decodeVar(uint32_t i, const char * p, uint64_t stride,
+                           uint64_t first, uint64_t m, dtaSink &sink)
+{
+  int32_t const type = h.vartype[i];
+
+  switch(type < 2046 ? 2045 : type)
+  {
+    // double
+  case 65526:
+    d.resize(m);
+    for (uint64_t j=0; j<m; ++j, p += stride)
+    {
+      d[j] = loadbin<double>(p, h.swapit);
+      bool const miss = !(d[j] == -HUGE_VAL) &&
+        ((d[j]<STATA_DOUBLE_NA_MIN) | (d[j]>STATA_DOUBLE_NA_MAX));
+      na[j] = miss ? dtaMissingType(p, type, h.swapit) : -1;
+    }
+    sink.doubles(i, first, m, &d[0], &na[0]);
+    break;
+    // float
+  case 65527:
+    d.resize(m);
+    for (uint64_t j=0; j<m; ++j, p += stride)
+    {
+      float const val = loadbin<float>(p, h.swapit);
+      d[j] = val;
+      bool const miss = (val<STATA_FLOAT_NA_MIN) | (val>STATA_FLOAT_NA_MAX);
+      na[j] = miss ? dtaMissingType(p, type, h.swapit) : -1;
+    }
+    sink.doubles(i, first, m, &d[0], &na[0]);
+    break;
+    // long
+  case 65528:
+    l.resize(m);
+    for (uint64_t j=0; j<m; ++j, p += stride)
+    {
+      l[j] = loadbin<int32_t>(p, h.swapit);
+      bool const miss = (l[j]<STATA_INT_NA_MIN) | (l[j]>STATA_INT_NA_MAX);
+      na[j] = miss ? dtaMissingType(p, type, h.swapit) : -1;
+    }
+    sink.ints(i, first, m, &l[0], &na[0]);
+    break;
+    // int
+  case 65529:
+    l.resize(m);
+    for (uint64_t j=0; j<m; ++j, p += stride)
+    {
+      l[j] = loadbin<int16_t>(p, h.swapit);
+      bool const miss =
+        (l[j]<STATA_SHORTINT_NA_MIN) | (l[j]>STATA_SHORTINT_NA_MAX);
+      na[j] = miss ? dtaMissingType(p, type, h.swapit) : -1;
+    }
+    sink.ints(i, first, m, &l[0], &na[0]);
+    break;
+    // byte
+  case 65530:
+    l.resize(m);
+    for (uint64_t j=0; j<m; ++j, p += stride)
+    {
+      l[j] = (int8_t)*p;
+      bool const miss = (l[j]<STATA_BYTE_NA_MIN) | (l[j]>STATA_BYTE_NA_MAX);
+      na[j] = miss ? dtaMissingType(p, type, h.swapit) : -1;
+    }
+    sink.ints(i, first, m, &l[0], &na[0]);
+    break;
+    // strings with 2045 or fewer characters
+  case 2045:
+    s.resize(m * type);
+    for (uint64_t j=0; j<m; ++j, p += stride)
+      memcpy(&s[j * type], p, type);
+    sink.strings(i, first, m, s.data(), type);
+    break;
+    // string of any length
+  case 32768:
+    ref.resize(m);
+    for (uint64_t j=0; j<m; ++j, p += stride)
+      ref[j] = dtaLoadStrl(p, h.release, h.swapit);
+    sink.strls(i, first, m, &ref[0]);
+    break;
+  }
+}
+
+uint64_t dtaBlockRows(const dtaHeader &h)
+{
+  if (h.rowlen == 0 || h.rowlen >= (1 << 25))
+    return 1;
+  uint64_t rows = (1 << 20) / h.rowlen;
+  if (rows < dtaTileRows)
+    rows = std::min<uint64_t>(dtaTileRows, (1 << 25) / h.rowlen);
+  return rows > 0 ? rows : 1;
+}
+
+std::vector<dtaRange> dtaBlockRanges(const dtaHeader &h, uint64_t n,
+                                     uint64_t block)
+{
+  std::vector<dtaRange> ranges;
+  for (uint64_t j=0; j<n; j+=block)
+  {
+    dtaRange range;
+    range.pos = h.data + j * h.rowlen;
+    range.len = ((n - j < block) ? n - j : block) * h.rowlen;
+    ranges.push_back(range);
+  }
+  return ranges;
+}
+
+void dtaReadData(FILE * file, const dtaHeader &h, dtaSink &sink)
+{
+  uint64_t const block = dtaBlockRows(h);
+
+  dtaDecoder dec(h);
+  dtaPrefetch pf(file, dtaBlockRanges(h, h.n, block), true);
+
+  for (uint64_t j=0; j<h.n; )
+  {
+    uint64_t const m = (h.n - j < block) ? h.n - j : block;
+    const std::string &buf = pf.next();
+    dtaProf.buffer(buf.size());
+    dec.decode(buf.data(), j, m, sink);
+    j += m;
+  }
+}
+
+// final mix of splitmix64, spreads the bits of x over the hash
+static inline uint64_t dtaMix(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+void dtaStats::add(uint64_t hash)
+{
+  if (reg.empty())
+    reg.resize(1 << dtaStatsBits, 0);
+
+  // the first bits choose the register, it keeps the most leading zeros + 1
+  uint64_t const idx = hash >> (64 - dtaStatsBits);
+  uint64_t w = hash << dtaStatsBits;
+  uint8_t rank = 1;
+  while (rank <= 64 - dtaStatsBits && !(w & ((uint64_t)1 << 63)))
+  {
+    ++rank;
+    w <<= 1;
+  }
+  if (rank > reg[idx])
+    reg[idx] = rank;
+}
+
+double dtaStats::distinct() const
+{
+  if (reg.empty())
+    return 0;
+
+  double const m = reg.size();
+  double sum = 0, zeros = 0;
+  for (size_t j=0; j<reg.size(); ++j)
+  {
+    sum += ldexp(1.0, -reg[j]);
+    if (reg[j] == 0)
+      ++zeros;
+  }
+
+  double const est = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+  // few distinct values are counted by the empty registers
+  if (est <= 2.5 * m && zeros > 0)
+    return floor(m * log(m / zeros) + 0.5);
+  return floor(est + 0.5);
+}
+
+void dtaStatsSink::doubles(uint32_t i, uint64_t first, uint64_t m,
+                           const double * val, const int8_t * natype)
+{
+  dtaStats &st = stats[i];
+  for (uint64_t j=0; j<m; ++j)
+  {
+    if (natype[j] == 0)
+      ++st.na;
+    if (natype[j] > 0)
+      ++st.extended;
+    if (natype[j] >= 0)
+      continue;
+    double const x = val[j];
+    ++st.count;
+    st.sum += x;
+    if (x < st.min)
+      st.min = x;
+    if (x > st.max)
+      st.max = x;
+
+    // -0 and 0 are the same value
+    uint64_t bits = 0;
+    if (x != 0)
+      memcpy(&bits, &x, sizeof(x));
+    st.add(dtaMix(bits));
+  }
+  next.doubles(i, first, m, val, natype);
+}
+
+void dtaStatsSink::ints(uint32_t i, uint64_t first, uint64_t m,
+                        const int32_t * val, const int8_t * natype)
+{
+  dtaStats &st = stats[i];
+  for (uint64_t j=0; j<m; ++j)
+  {
+    if (natype[j] == 0)
+      ++st.na;
+    if (natype[j] > 0)
+      ++st.extended;
+    if (natype[j] >= 0)
+      continue;
+    double const x = val[j];
+    ++st.count;
+    st.sum += x;
+    if (x < st.min)
+      st.min = x;
+    if (x > st.max)
+      st.max = x;
+    st.add(dtaMix((uint64_t)(int64_t)val[j]));
+  }
+  next.ints(i, first, m, val, natype);
+}
+
+void dtaStatsSink::strings(uint32_t i, uint64_t first, uint64_t m,
+                           const char * val, int32_t width)
+{
+  dtaStats &st = stats[i];
+  for (uint64_t j=0; j<m; ++j)
+  {
+    // 64 bit FNV-1a hash of the string up to its binary 0
+    const char * p = val + j * width;
+    uint64_t hash = 14695981039346656037ULL;
+    for (int32_t c=0; c<width && p[c] != '\0'; ++c)
+    {
+      hash ^= (unsigned char)p[c];
+      hash *= 1099511628211ULL;
+    }
+    ++st.count;
+    st.add(dtaMix(hash));
+  }
+  next.strings(i, first, m, val, width);
+}
+
+void dtaStatsSink::strls(uint32_t i, uint64_t first, uint64_t m,
+                         const uint64_t * ref)
+{
+  stats[i].count += m;
+  next.strls(i, first, m, ref);
+}
+
+#ifdef DTA_PREFETCH_THREAD
+
+dtaPrefetch::dtaPrefetch(FILE * file, const std::vector<dtaRange> &ranges,
+                         bool sequential, size_t depth) :
+  file(file), ranges(ranges), ring(depth > 0 ? depth : 1), handed(0),
+  fd(fileno(file)), released(0), produced(0), stop(false), failed(false),
+  started(false)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+  if (sequential && !ranges.empty())
+    posix_fadvise(fd, ranges.front().pos,
+                  ranges.back().pos + ranges.back().len - ranges.front().pos,
+                  POSIX_FADV_SEQUENTIAL);
+#else
+  (void)sequential;
+#endif
+
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+  // without a thread next() reads the ranges itself
+  started = pthread_create(&thread, NULL, run, this) == 0;
+}
+
+dtaPrefetch::~dtaPrefetch()
+{
+  pthread_mutex_lock(&mutex);
+  stop = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+
+  if (started)
+    pthread_join(thread, NULL);
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+void * dtaPrefetch::run(void * self)
+{
+  static_cast<dtaPrefetch *>(self)->fill();
+  return NULL;
+}
+
+bool dtaPrefetch::read(size_t i, std::string &buf)
+{
+  buf.resize(ranges[i].len);
+  for (uint64_t done = 0; done < ranges[i].len; )
+  {
+    ssize_t const r = pread(fd, &buf[done], ranges[i].len - done,
+                            ranges[i].pos + done);
+    if (r <= 0)
+      return false;
+    done += r;
+  }
+  return true;
+}
+
+/* the background thread. It must neither call R nor throw. */
+void dtaPrefetch::fill()
+{
+  size_t const depth = ring.size();
+
+  for (size_t i = 0; i < ranges.size(); ++i)
+  {
+    // wait until the caller is done with the range that used this buffer
+    pthread_mutex_lock(&mutex);
+    while (!stop && i >= released + depth)
+      pthread_cond_wait(&cond, &mutex);
+    bool const quit = stop;
+    pthread_mutex_unlock(&mutex);
+    if (quit)
+      return;
+
+#ifdef POSIX_FADV_WILLNEED
+    // the kernel reads the range following the ring meanwhile
+    if (i + depth < ranges.size())
+      posix_fadvise(fd, ranges[i + depth].pos, ranges[i + depth].len,
+                    POSIX_FADV_WILLNEED);
+#endif
+
+    bool const ok = read(i, ring[i % depth]);
+
+    pthread_mutex_lock(&mutex);
+    if (ok)
+      produced = i + 1;
+    else
+      failed = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+    if (!ok)
+      return;
+  }
+}
+
+const std::string &dtaPrefetch::next()
+{
+  if (handed >= ranges.size())
+    throw std::range_error("prefetch: no range left");
+
+  std::string &buf = ring[handed % ring.size()];
+  bool ok = true;
+
+  if (started)
+  {
+    pthread_mutex_lock(&mutex);
+    // the buffer of the previous range is free again
+    released = handed;
+    pthread_cond_broadcast(&cond);
+    while (produced <= handed && !failed)
+      pthread_cond_wait(&cond, &mutex);
+    ok = produced > handed;
+    pthread_mutex_unlock(&mutex);
+  } else {
+    ok = read(handed, buf);
+  }
+
+  if (!ok)
+    throw std::range_error("prefetch: a binary read error occurred");
+
+  ++handed;
+  dtaProf.io(buf.size());
+  return buf;
+}
+
+#else
+
+dtaPrefetch::dtaPrefetch(FILE * file, const std::vector<dtaRange> &ranges,
+                         bool, size_t) :
+  file(file), ranges(ranges), ring(1), handed(0)
+{
+}
+
+dtaPrefetch::~dtaPrefetch()
+{
+}
+
+const std::string &dtaPrefetch::next()
+{
+  if (handed >= ranges.size())
+    throw std::range_error("prefetch: no range left");
+
+  std::string &buf = ring[0];
+  buf.resize(ranges[handed].len);
+  dtaFileSeek(file, ranges[handed].pos);
+  dtaReadString(file, buf);
+  ++handed;
+  return buf;
+}
+
+#endif
+
+void dtaMove(FILE * file, uint64_t from, uint64_t to, int64_t delta)
+{
+  std::string buf;
+  uint64_t const len = to - from;
+
+  for (uint64_t done = 0; delta != 0 && done < len; )
+  {
+    uint64_t const m = (len - done < (1 << 20)) ? len - done : (1 << 20);
+    // a gap is closed from the start, room is made from the end
+    uint64_t const pos = (delta < 0) ? from + done : to - done - m;
+
+    buf.resize(m);
+    dtaFileSeek(file, pos);
+    dtaReadString(file, buf);
+    dtaFileSeek(file, pos + delta);
+    dtaProf.io(m);
+    if (fwrite(buf.data(), m, 1, file) != 1)
+      throw std::range_error("move: a write error occurred");
+    done += m;
+  }
+}
+
+void dtaWriteMap(FILE * file, const dtaHeader &h)
+{
+  dtaFileSeek(file, h.map[1] + 5); // <map>
+  for (int i = 0; i < 14; ++i)
+  {
+    uint64_t const pos = h.swapit ? swap_endian(h.map[i]) : h.map[i];
+    if (fwrite(&pos, sizeof(pos), 1, file) != 1)
+      throw std::range_error("map: a write error occurred");
+  }
+}
+
+void dtaTruncate(FILE * file, uint64_t size)
+{
+  fflush(file);
+#ifdef _WIN32
+  int const err = _chsize_s(_fileno(file), size);
+#else
+  int const err = ftruncate(fileno(file), size);
+#endif
+  if (err != 0)
+    throw std::range_error("truncate: unable to resize the file");
+}
+
+dtaEncoder::dtaEncoder(const std::vector<int32_t> &vartype, uint8_t release,
+                       bool swapit) :
+  vartype(vartype), coloff(vartype.size()), rowlen(0), m(0), release(release),
+  swapit(swapit)
+{
+  for (size_t i=0; i<vartype.size(); ++i)
+  {
+    coloff[i] = rowlen;
+    rowlen += dtaWidth(vartype[i]);
+  }
+}
+
+void dtaEncoder::begin(uint64_t m)
+{
+  this->m = m;
+  buf.assign(m * rowlen, 0);
+}
+
+void dtaEncoder::doubles(uint32_t i, const double * val)
+{
+  char * p = &buf[0] + coloff[i];
+
+  if (vartype[i] == 65526)
+  {
+    for (uint64_t j=0; j<m; ++j, p += rowlen)
+      store(p, dtaIsNaN(val[j]) ? (double)STATA_DOUBLE_NA : val[j]);
+  } else {
+    for (uint64_t j=0; j<m; ++j, p += rowlen)
+      store(p, dtaIsNaN(val[j]) ? (float)(STATA_FLOAT_NA) : (float)val[j]);
+  }
+}
+
+void dtaEncoder::ints(uint32_t i, const int32_t * val)
+{
+  char * p = &buf[0] + coloff[i];
+
+  switch(vartype[i])
+  {
+    // long
+  case 65528:
+    for (uint64_t j=0; j<m; ++j, p += rowlen)
+      store(p, val[j] == dtaIntNA ? (int32_t)STATA_INT_NA : val[j]);
+    break;
+    // int
+  case 65529:
+    for (uint64_t j=0; j<m; ++j, p += rowlen)
+      store(p, val[j] == dtaIntNA ? (int16_t)STATA_SHORTINT_NA :
+              (int16_t)val[j]);
+    break;
+    // byte
+  case 65530:
+    for (uint64_t j=0; j<m; ++j, p += rowlen)
+      *p = val[j] == dtaIntNA ? (int8_t)STATA_BYTE_NA : (int8_t)val[j];
+    break;
+  }
+}
+
+void dtaEncoder::strings(uint32_t i, const char * const * val,
+                         const size_t * len)
+{
+  char * p = &buf[0] + coloff[i];
+  size_t const width = vartype[i];
+
+  for (uint64_t j=0; j<m; ++j, p += rowlen)
+    memcpy(p, val[j], len[j] < width ? len[j] : width);
+}
+
+void dtaEncoder::strls(uint32_t i, const uint64_t * ref)
+{
+  char * p = &buf[0] + coloff[i];
+
+  for (uint64_t j=0; j<m; ++j, p += rowlen)
+    dtaStoreStrl(p, ref[j], release, swapit);
+}
+
+dtaRowReader::dtaRowReader(FILE * file, const dtaHeader &h) :
+  h(h), block(dtaBlockRows(h)), pf(file, dtaBlockRanges(h, h.n, block), true),
+  p(NULL), i(0), end(0)
+{
+  if (h.n > 0)
+  {
+    p = pf.next().data();
+    end = std::min(block, h.n);
+  }
+}
+
+void dtaRowReader::skip(uint64_t m)
+{
+  i += m;
+  p += m * h.rowlen;
+  if (i == end && i < h.n)
+  {
+    p = pf.next().data();
+    end = std::min(i + block, h.n);
+  }
+}
+
+bool dtaSameLayout(const dtaHeader &a, const dtaHeader &b)
+{
+  return a.release == b.release && a.byteorder == b.byteorder &&
+    a.vartype == b.vartype;
+}
+
+// TRUE if len bytes at pa of fa and at pb of fb are the same
+static bool dtaSameBytes(FILE * fa, uint64_t pa, FILE * fb, uint64_t pb,
+                         uint64_t len)
+{
+  std::string x, y;
+  dtaFileSeek(fa, pa);
+  dtaFileSeek(fb, pb);
+  for (uint64_t j=0; j<len; )
+  {
+    uint64_t const m = std::min<uint64_t>(len - j, 1 << 20);
+    x.resize(m);
+    y.resize(m);
+    dtaReadString(fa, x);
+    dtaReadString(fb, y);
+    if (x != y)
+      return false;
+    j += m;
+  }
+  return true;
+}
+
+std::vector<std::string> dtaDiffMeta(FILE * fa, const dtaHeader &a,
+                                     FILE * fb, const dtaHeader &b)
+{
+  std::vector<std::string> res;
+
+  if (a.release != b.release)
+    res.push_back("release");
+  if (a.byteorder != b.byteorder)
+    res.push_back("byteorder");
+  if (a.datalabel != b.datalabel)
+    res.push_back("label");
+
+  // sections in <map> and the one that follows each
+  static const int sec[] = {2, 3, 4, 5, 6, 7, 8, 11};
+  static const char * name[] = {"variable_types", "varnames", "sortlist",
+                                "formats", "value_label_names",
+                                "variable_labels", "characteristics",
+                                "value_labels"};
+
+  for (int i=0; i<8; ++i)
+  {
+    uint64_t const lena = a.map[sec[i] + 1] - a.map[sec[i]];
+    uint64_t const lenb = b.map[sec[i] + 1] - b.map[sec[i]];
+    if (lena != lenb ||
+        !dtaSameBytes(fa, a.map[sec[i]], fb, b.map[sec[i]], lena))
+      res.push_back(name[i]);
+  }
+  return res;
+}
+
+// 64 bit FNV-1a hash of no bytes, the hash of empty strLs
+static const uint64_t dtaHashEmpty = 14695981039346656037ULL;
+
+/* (reference, hash) of the contents of all strLs in <strls>, sorted by
+ * reference. The binary 0 ending strLs of type 130 is not hashed.
+ */
+static std::vector< std::pair<uint64_t, uint64_t> >
+  dtaStrlHashes(FILE * file, const dtaHeader &h)
+{
+  std::vector< std::pair<uint64_t, uint64_t> > res;
+  std::string tags(3, '\0'), head(dtaGsoSize(h.release), '\0'), buf;
+
+  dtaFileSeek(file, h.map[10]);
+  dtaTest(file, "<strls>");
+  dtaReadString(file, tags);
+
+  while (tags == "GSO")
+  {
+    dtaGso g;
+    dtaReadString(file, head);
+    dtaDecodeGso(head.data(), h.release, h.swapit, g);
+    uint32_t const len = g.len;
+
+    uint64_t const text = (g.t == 130 && len > 0) ? len - 1 : len;
+    uint64_t hash = dtaHashEmpty;
+    for (uint64_t j=0; j<len; )
+    {
+      uint64_t const m = std::min<uint64_t>(len - j, 1 << 20);
+      buf.resize(m);
+      dtaReadString(file, buf);
+      for (uint64_t c=0; c<m && j + c < text; ++c)
+      {
+        hash ^= (unsigned char)buf[c];
+        hash *= 1099511628211ULL;
+      }
+      j += m;
+    }
+
+    res.push_back(std::make_pair(g.ref, hash));
+    dtaReadString(file, tags);
+  }
+
+  std::sort(res.begin(), res.end());
+  return res;
+}
+
+dtaDiff::dtaDiff(FILE * fa, const dtaHeader &a, FILE * fb, const dtaHeader &b,
+                 const std::vector<uint32_t> &key) :
+  a(a), b(b), key(key), strlA(dtaStrlHashes(fa, a)),
+  strlB(dtaStrlHashes(fb, b)), ra(fa, a), rb(fb, b)
+{
+  if (!dtaSameLayout(a, b))
+    throw std::range_error("diff: the variables of both files differ");
+
+  for (uint32_t i=0; i<a.k; ++i)
+    if (a.vartype[i] == 32768)
+      strlcols.push_back(i);
+
+  for (size_t i=0; i<key.size(); ++i)
+    if (key[i] >= a.k || a.vartype[key[i]] == 32768)
+      throw std::range_error("diff: a key is no variable or a strL");
+
+  // strLs of the same reference in both files with different contents
+  size_t x = 0, y = 0;
+  while (x < strlA.size() || y < strlB.size())
+  {
+    if (y == strlB.size() ||
+        (x < strlA.size() && strlA[x].first < strlB[y].first))
+    {
+      dirty.push_back(strlA[x++].first);
+    } else if (x == strlA.size() || strlB[y].first < strlA[x].first) {
+      dirty.push_back(strlB[y++].first);
+    } else {
+      if (strlA[x].second != strlB[y].second)
+        dirty.push_back(strlA[x].first);
+      ++x;
+      ++y;
+    }
+  }
+}
+
+/* Order of the keys of two observations as Stata sorts: numbers by value
+ * (missings are larger than all values), strings bytewise
+ */
+int dtaDiff::compareKey(const char * x, const char * y) const
+{
+  for (size_t i=0; i<key.size(); ++i)
+  {
+    int32_t const type = a.vartype[key[i]];
+    const char * p = x + a.coloff[key[i]];
+    const char * q = y + a.coloff[key[i]];
+    double u = 0, w = 0;
+
+    switch(type < 2046 ? 2045 : type)
+    {
+    case 65526:
+      u = loadbin<double>(p, a.swapit);
+      w = loadbin<double>(q, a.swapit);
+      break;
+    case 65527:
+      u = loadbin<float>(p, a.swapit);
+      w = loadbin<float>(q, a.swapit);
+      break;
+    case 65528:
+      u = loadbin<int32_t>(p, a.swapit);
+      w = loadbin<int32_t>(q, a.swapit);
+      break;
+    case 65529:
+      u = loadbin<int16_t>(p, a.swapit);
+      w = loadbin<int16_t>(q, a.swapit);
+      break;
+    case 65530:
+      u = (int8_t)*p;
+      w = (int8_t)*q;
+      break;
+    case 2045:
+      for (int32_t c=0; c<type; ++c)
+      {
+        u = (unsigned char)p[c];
+        w = (unsigned char)q[c];
+        if (u != w || u == 0)
+          break;
+      }
+      break;
+    }
+
+    if (u < w)
+      return -1;
+    if (u > w)
+      return 1;
+  }
+  return 0;
+}
+
+uint64_t dtaDiff::strlHash(const std::vector< std::pair<uint64_t, uint64_t> > &t,
+                           const char * p) const
+{
+  std::pair<uint64_t, uint64_t> const ref(dtaLoadStrl(p, a.release,
+                                                      a.swapit), 0);
+  std::vector< std::pair<uint64_t, uint64_t> >::const_iterator it =
+    std::lower_bound(t.begin(), t.end(), ref);
+  if (it == t.end() || it->first != ref.first)
+    return dtaHashEmpty;
+  return it->second;
+}
+
+// bytes and strLs of two observations are the same
+bool dtaDiff::sameRow(const char * x, const char * y) const
+{
+  uint64_t pos = 0;
+  for (size_t i=0; i<strlcols.size(); ++i)
+  {
+    uint64_t const off = a.coloff[strlcols[i]];
+    if (memcmp(x + pos, y + pos, off - pos) != 0 ||
+        strlHash(strlA, x + off) != strlHash(strlB, y + off))
+      return false;
+    pos = off + 8;
+  }
+  return memcmp(x + pos, y + pos, a.rowlen - pos) == 0;
+}
+
+// m observations at x refer to a strL that differs between both files
+bool dtaDiff::dirtyRows(const char * x, uint64_t m) const
+{
+  if (dirty.empty() || strlcols.empty())
+    return false;
+  for (uint64_t j=0; j<m; ++j, x += a.rowlen)
+    for (size_t i=0; i<strlcols.size(); ++i)
+    {
+      uint64_t const ref = dtaLoadStrl(x + a.coloff[strlcols[i]], a.release,
+                                       a.swapit);
+      if (std::binary_search(dirty.begin(), dirty.end(), ref))
+        return true;
+    }
+  return false;
+}
+
+/* checks the keys of m observations at p to follow the last key prev and
+ * keeps the last of them in prev
+ */
+void dtaDiff::sorted(std::string &prev, const char * p, uint64_t m,
+                     const char * file)
+{
+  const char * last = prev.empty() ? NULL : prev.data();
+  for (uint64_t j=0; j<m; ++j, p += a.rowlen)
+  {
+    if (last != NULL && compareKey(last, p) > 0)
+      throw std::range_error(std::string("diff: ") + file +
+                             " file is not sorted by the key");
+    last = p;
+  }
+  prev.assign(last, a.rowlen);
+}
+
+void dtaDiff::nextOld()
+{
+  if (!key.empty())
+    sorted(prevA, ra.row(), 1, "old");
+  ra.skip(1);
+}
+
+void dtaDiff::nextNew()
+{
+  if (!key.empty())
+    sorted(prevB, rb.row(), 1, "new");
+  rb.skip(1);
+}
+
+bool dtaDiff::step()
+{
+  uint64_t const block = dtaBlockRows(a);
+
+  for (uint64_t j=0; j<block; )
+  {
+    uint64_t const la = ra.left(), lb = rb.left();
+
+    if (la == 0 && lb == 0)
+      return false;
+    if (la == 0)
+    {
+      added.push_back(rb.index());
+      nextNew();
+      ++j;
+      continue;
+    }
+    if (lb == 0)
+    {
+      removed.push_back(ra.index());
+      nextOld();
+      ++j;
+      continue;
+    }
+
+    // the same bytes: the same keys and values
+    uint64_t const m = std::min(std::min(la, lb), dtaTileRows);
+    if (memcmp(ra.row(), rb.row(), m * a.rowlen) == 0 &&
+        !dirtyRows(ra.row(), m))
+    {
+      if (!key.empty())
+      {
+        sorted(prevA, ra.row(), m, "old");
+        prevB = prevA;
+      }
+      ra.skip(m);
+      rb.skip(m);
+      j += m;
+      continue;
+    }
+
+    for (uint64_t r=0; r<m && ra.left() > 0 && rb.left() > 0; ++r, ++j)
+    {
+      int const c = key.empty() ? 0 : compareKey(ra.row(), rb.row());
+      if (c == 0)
+      {
+        if (!sameRow(ra.row(), rb.row()))
+        {
+          changedOld.push_back(ra.index());
+          changedNew.push_back(rb.index());
+        }
+        nextOld();
+        nextNew();
+      } else if (c < 0) {
+        removed.push_back(ra.index());
+        nextOld();
+      } else {
+        added.push_back(rb.index());
+        nextNew();
+      }
+    }
+  }
+  return ra.left() > 0 || rb.left() > 0;
+}
+
+uint64_t dtaDiff::done() const
+{
+  return (ra.index() + rb.index()) * a.rowlen;
+}
@@ -0,0 +1,554 @@
+#ifndef DTACORE
+#define DTACORE
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <typeinfo>
+#include <vector>
+#include <stdint.h>
+#ifndef _WIN32
+#include <pthread.h>
+#define DTA_PREFETCH_THREAD
+#endif
+#include "dtaprofile.h"
+#include "statadefines.h"
+#include "swap_endian.h"
+
+/* The dta-format without R. Parsing of the header, decoding of <data> into
+ * typed column buffers and encoding of such buffers into <data>. stata() and
+ * stataWrite() are adapters on top of it, dtacore.cpp builds on its own:
+ *
+ *   g++ -O2 -pthread -c dtacore.cpp dtaprofile.cpp
+ *
+ * Errors are thrown as std::range_error.
+ */
+
+/* missing integers in column buffers, the same as NA_INTEGER of R */
+static const int32_t dtaIntNA = -2147483647 - 1;
+
+static inline bool dtaIsNaN(double x)
+{
+  return x != x;
+}
+
+/* Decoding of a single value in <data>. The value starts at p, which points
+ * into a buffer holding one or more observations.
+ */
+template <typename T>
+static inline T loadbin(const char * p, bool swapit)
+{
+  T t;
+  memcpy(&t, p, sizeof(t));
+  if (swapit==0)
+    return(t);
+  else
+    return(swap_endian(t));
+}
+
+/* Encoding of a single value into a buffer, the reverse of loadbin */
+template <typename T>
+static inline void storebin(char * p, T t, bool swapit)
+{
+  if (swapit)
+    t = swap_endian(t);
+  memcpy(p, &t, sizeof(t));
+}
+
+// bytes used by a variable of type vartype in each observation
+static inline int32_t dtaWidth(int32_t vartype)
+{
+  switch(vartype < 2046 ? 2045 : vartype)
+  {
+  case 65526: return 8;
+  case 65527: return 4;
+  case 65528: return 4;
+  case 65529: return 2;
+  case 65530: return 1;
+  case 32768: return 8;
+  default:    return vartype;
+  }
+}
+
+/* Missing type of a numeric value in the range of Stata missings: 0 for . and
+ * 1 to 26 for .a to .z
+ */
+static inline int dtaMissingType(const char * p, int32_t vartype, bool swapit)
+{
+  double val = 0, min = 0, inc = 1;
+
+  switch(vartype)
+  {
+  case 65526:
+    val = loadbin<double>(p, swapit);
+    min = ldexp(1.0, 1023);
+    inc = ldexp(1.0, 1011);
+    break;
+  case 65527:
+    val = loadbin<float>(p, swapit);
+    min = ldexp(1.0, 127);
+    inc = ldexp(1.0, 115);
+    break;
+  case 65528: val = loadbin<int32_t>(p, swapit); min = 2147483621; break;
+  case 65529: val = loadbin<int16_t>(p, swapit); min = 32741; break;
+  case 65530: val = (int8_t)*p; min = 101; break;
+  }
+
+  if (!(val >= min))
+    return 0;
+  return (int)((val - min) / inc);
+}
+
+/* A FILE that is closed when it goes out of scope, also if reading or writing
+ * is interrupted or an error is thrown.
+ */
+class dtaFile
+{
+public:
+  dtaFile(const char * filePath, const char * mode) :
+  file(fopen(filePath, mode)) {}
+  ~dtaFile() { if (file != NULL) fclose(file); }
+
+  operator FILE *() const { return file; }
+
+  /* closes the file early, returns the result of fclose */
+  int close()
+  {
+    int const res = (file != NULL) ? fclose(file) : 0;
+    file = NULL;
+    return res;
+  }
+
+private:
+  dtaFile(const dtaFile &);
+  dtaFile &operator=(const dtaFile &);
+
+  FILE * file;
+};
+
+/* Everything up to <varnames>: the header, the <map> and the variable types.
+ * Lengths of the fixed width fields that follow depend on the release.
+ */
+struct dtaHeader
+{
+  uint8_t release;
+  std::string byteorder;
+  bool swapit;
+  uint32_t k;
+  uint64_t n;
+  std::string datalabel;
+  std::string timestamp;
+
+  /* byte positions of the 14 sections of the file */
+  std::vector<uint64_t> map;
+  std::vector<int32_t> vartype;
+
+  /* each variable starts at coloff within an observation of rowlen bytes */
+  std::vector<uint64_t> coloff;
+  uint64_t rowlen;
+  uint64_t data;                  // first byte of the first observation
+
+  uint8_t nvarnameslen, nformatslen, nvalLabelslen, lbllen;
+  uint16_t nvarLabelslen;
+  int32_t chlen;
+
+  dtaHeader() : release(0), swapit(0), k(0), n(0), map(14, 0), rowlen(0),
+  data(0), nvarnameslen(0), nformatslen(0), nvalLabelslen(0), lbllen(0),
+  nvarLabelslen(0), chlen(0) {}
+};
+
+/* strLs are referenced by (v,o), their variable and observation. In 117 v
+ * and o take 4 bytes each. In 118 and 119 they share 8 bytes: v the lower 16
+ * (118) or 24 bits (119) and o the others. A reference is kept as one number
+ * (o << dtaStrlShift) | v, in 118 and 119 the 8 bytes read at once.
+ */
+static inline int dtaStrlShift(uint8_t release)
+{
+  return (release == 117) ? 32 : (release == 118) ? 16 : 24;
+}
+
+static inline uint64_t dtaStrlRef(uint64_t v, uint64_t o, uint8_t release)
+{
+  return (o << dtaStrlShift(release)) | v;
+}
+
+static inline uint64_t dtaStrlV(uint64_t ref, uint8_t release)
+{
+  return ref & ((1ULL << dtaStrlShift(release)) - 1);
+}
+
+static inline uint64_t dtaStrlO(uint64_t ref, uint8_t release)
+{
+  return ref >> dtaStrlShift(release);
+}
+
+/* reference of a strL at p in <data> */
+static inline uint64_t dtaLoadStrl(const char * p, uint8_t release,
+                                   bool swapit)
+{
+  if (release == 117)
+    return dtaStrlRef(loadbin<uint32_t>(p, swapit),
+                      loadbin<uint32_t>(p + 4, swapit), release);
+  return loadbin<uint64_t>(p, swapit);
+}
+
+static inline void dtaStoreStrl(char * p, uint64_t ref, uint8_t release,
+                                bool swapit)
+{
+  if (release == 117)
+  {
+    storebin(p, (uint32_t)dtaStrlV(ref, release), swapit);
+    storebin(p + 4, (uint32_t)dtaStrlO(ref, release), swapit);
+  } else {
+    storebin(p, ref, swapit);
+  }
+}
+
+/* A strL in <strls> is "GSO", v (4 bytes), o (4 bytes in 117, 8 bytes in
+ * 118 and 119), t and len (4 bytes) followed by len bytes. t is 129 for
+ * binary strLs and 130 for strLs ending with a binary 0.
+ */
+struct dtaGso
+{
+  uint64_t ref;
+  uint8_t t;
+  uint32_t len;
+};
+
+// bytes of a GSO after "GSO" and before its contents
+static inline size_t dtaGsoSize(uint8_t release)
+{
+  return (release == 117) ? 13 : 17;
+}
+
+static inline void dtaDecodeGso(const char * p, uint8_t release, bool swapit,
+                                dtaGso &g)
+{
+  uint64_t const v = loadbin<uint32_t>(p, swapit);
+  uint64_t const o = (release == 117) ? loadbin<uint32_t>(p + 4, swapit) :
+    loadbin<uint64_t>(p + 4, swapit);
+  p += (release == 117) ? 8 : 12;
+  g.ref = dtaStrlRef(v, o, release);
+  g.t = *p;
+  g.len = loadbin<uint32_t>(p + 1, swapit);
+}
+
+static inline void dtaEncodeGso(char * p, const dtaGso &g, uint8_t release,
+                                bool swapit)
+{
+  storebin(p, (uint32_t)dtaStrlV(g.ref, release), swapit);
+  if (release == 117)
+    storebin(p + 4, (uint32_t)dtaStrlO(g.ref, release), swapit);
+  else
+    storebin(p + 4, dtaStrlO(g.ref, release), swapit);
+  p += (release == 117) ? 8 : 12;
+  *p = g.t;
+  storebin(p + 1, g.len, swapit);
+}
+
+/* Reads the header of a dta-file opened in binary mode. Afterwards the file
+ * is positioned at <varnames>.
+ */
+void dtaReadHeader(FILE * file, dtaHeader &h);
+
+/* Receives decoded observations variable by variable. Each call passes the
+ * values of variable i for the observations [first, first + m). natype is -1
+ * for values and the missing type (see dtaMissingType) for Stata missings.
+ */
+class dtaSink
+{
+public:
+  virtual ~dtaSink() {}
+  virtual void doubles(uint32_t i, uint64_t first, uint64_t m,
+                       const double * val, const int8_t * natype) = 0;
+  virtual void ints(uint32_t i, uint64_t first, uint64_t m,
+                    const int32_t * val, const int8_t * natype) = 0;
+  /* m strings of width bytes, padded with binary 0 */
+  virtual void strings(uint32_t i, uint64_t first, uint64_t m,
+                       const char * val, int32_t width) = 0;
+  /* references of m strLs (see dtaStrlRef) */
+  virtual void strls(uint32_t i, uint64_t first, uint64_t m,
+                     const uint64_t * ref) = 0;
+};
+
+/* Decodes blocks of observations into a sink */
+class dtaDecoder
+{
+public:
+  dtaDecoder(const dtaHeader &h) : h(h) {}
+
+  /* m observations are stored one after another at obs. The first becomes
+   * observation first of the sink.
+   */
+  void decode(const char * obs, uint64_t first, uint64_t m, dtaSink &sink);
+
+private:
+  /* variable i of m observations, the first at p and each stride bytes after
+   * the one before
+   */
+  void decodeVar(uint32_t i, const char * p, uint64_t stride, uint64_t first,
+                 uint64_t m, dtaSink &sink);
+
+  const dtaHeader &h;
+  std::vector<double> d;
+  std::vector<int32_t> l;
+  std::vector<uint64_t> ref;
+  std::vector<int8_t> na;
+  std::string s, tile;
+};
+
+/* Observations decoded at once: as many as fit in 1MB. Wide observations are
+ * decoded in column tiles (see dtacore.cpp), their blocks hold more of them
+ * up to 32MB.
+ */
+uint64_t dtaBlockRows(const dtaHeader &h);
+
+/* Decodes all observations of a file positioned anywhere after dtaReadHeader.
+ * Used where no selection of observations is needed.
+ */
+void dtaReadData(FILE * file, const dtaHeader &h, dtaSink &sink);
+
+/* Statistics of a variable collected while decoding. count, min, max and sum
+ * are of the values, na counts the missings (.) and extended the missings .a
+ * to .z. The number of distinct values is estimated by a HyperLogLog of
+ * 2^dtaStatsBits registers (about 3% error). Strings have no min, max and
+ * sum, the distinct values of strLs are not known.
+ */
+static const int dtaStatsBits = 10;
+
+struct dtaStats
+{
+  uint64_t count, na, extended;
+  double min, max, sum;
+  std::vector<uint8_t> reg;
+
+  dtaStats() : count(0), na(0), extended(0), min(HUGE_VAL), max(-HUGE_VAL),
+  sum(0) {}
+
+  void add(uint64_t hash);
+  double distinct() const;
+};
+
+/* Collects the dtaStats of every variable and passes the values on to next */
+class dtaStatsSink : public dtaSink
+{
+public:
+  dtaStatsSink(const dtaHeader &h, dtaSink &next) : stats(h.k), next(next) {}
+
+  void doubles(uint32_t i, uint64_t first, uint64_t m, const double * val,
+               const int8_t * natype);
+  void ints(uint32_t i, uint64_t first, uint64_t m, const int32_t * val,
+            const int8_t * natype);
+  void strings(uint32_t i, uint64_t first, uint64_t m, const char * val,
+               int32_t width);
+  void strls(uint32_t i, uint64_t first, uint64_t m, const uint64_t * ref);
+
+  std::vector<dtaStats> stats;
+
+private:
+  dtaSink &next;
+};
+
+/* bytes [pos, pos + len) of a file */
+struct dtaRange
+{
+  uint64_t pos, len;
+};
+
+/* Reads a list of ranges of a file in their order. A background thread reads
+ * up to depth ranges ahead into a ring of buffers while the caller decodes,
+ * the kernel is told to read the ranges after these (posix_fadvise). The
+ * thread uses pread(), so the position of the FILE is not changed and the
+ * FILE must not be read by others until the prefetcher is destroyed. On
+ * Windows the ranges are read when they are requested.
+ */
+class dtaPrefetch
+{
+public:
+  dtaPrefetch(FILE * file, const std::vector<dtaRange> &ranges,
+              bool sequential, size_t depth = 4);
+  ~dtaPrefetch();
+
+  /* the next range. The buffer is valid until the following call. */
+  const std::string &next();
+
+  /* number of ranges returned by next() */
+  size_t position() const { return handed; }
+
+private:
+  dtaPrefetch(const dtaPrefetch &);
+  dtaPrefetch &operator=(const dtaPrefetch &);
+
+  FILE * file;
+  std::vector<dtaRange> ranges;
+  std::vector<std::string> ring;
+  size_t handed;                  // ranges returned by next()
+
+#ifdef DTA_PREFETCH_THREAD
+  static void * run(void * self);
+  void fill();
+  bool read(size_t i, std::string &buf);
+
+  int fd;
+  size_t released;                // ranges the caller is done with
+  size_t produced;                // ranges read by the thread
+  bool stop, failed, started;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+#endif
+};
+
+/* ranges of the first n observations in blocks of up to block observations */
+std::vector<dtaRange> dtaBlockRanges(const dtaHeader &h, uint64_t n,
+                                     uint64_t block);
+
+/* Moves the bytes [from, to) of a file opened for update by delta bytes in
+ * blocks of 1MB. Makes room for or closes the gap left by a section that was
+ * rewritten with a different size.
+ */
+void dtaMove(FILE * file, uint64_t from, uint64_t to, int64_t delta);
+
+/* Rewrites <map> with the positions in h.map */
+void dtaWriteMap(FILE * file, const dtaHeader &h);
+
+/* Cuts a file to size bytes */
+void dtaTruncate(FILE * file, uint64_t size);
+
+/* Encodes blocks of observations from column buffers into the layout of
+ * <data>. Missings are written as Stata missing . (NaN for doubles, dtaIntNA
+ * for integers).
+ */
+class dtaEncoder
+{
+public:
+  dtaEncoder(const std::vector<int32_t> &vartype, uint8_t release,
+             bool swapit);
+
+  /* starts a block of m observations */
+  void begin(uint64_t m);
+
+  void doubles(uint32_t i, const double * val);
+  void ints(uint32_t i, const int32_t * val);
+  /* val[j] holds len[j] bytes, longer strings are cut */
+  void strings(uint32_t i, const char * const * val, const size_t * len);
+  void strls(uint32_t i, const uint64_t * ref);
+
+  /* the encoded block */
+  const char * data() const { return buf.empty() ? NULL : &buf[0]; }
+  uint64_t size() const { return buf.size(); }
+
+private:
+  template <typename T>
+  void store(char * p, T t)
+  {
+    if (swapit)
+      t = swap_endian(t);
+    memcpy(p, &t, sizeof(t));
+  }
+
+  std::vector<int32_t> vartype;
+  std::vector<uint64_t> coloff;
+  uint64_t rowlen;
+  uint64_t m;
+  uint8_t release;
+  bool swapit;
+  std::vector<char> buf;
+};
+
+/* Observations of a file one after another, read ahead in blocks of
+ * dtaBlockRows observations by a dtaPrefetch. row() is valid as long as the
+ * block is not left.
+ */
+class dtaRowReader
+{
+public:
+  dtaRowReader(FILE * file, const dtaHeader &h);
+
+  /* the current observation and its index */
+  const char * row() const { return p; }
+  uint64_t index() const { return i; }
+
+  /* observations left in the block of the current one, 0 after the last */
+  uint64_t left() const { return end - i; }
+
+  /* moves m <= left() observations ahead */
+  void skip(uint64_t m);
+
+private:
+  const dtaHeader &h;
+  uint64_t block;
+  dtaPrefetch pf;
+  const char * p;
+  uint64_t i, end;
+};
+
+/* TRUE if the observations of both files are stored the same way: the same
+ * release, byte order and variable types.
+ */
+bool dtaSameLayout(const dtaHeader &a, const dtaHeader &b);
+
+/* Names of the parts of two files that differ: release, byteorder and label
+ * of the header and the sections before and after <data> (variable_types,
+ * varnames, sortlist, formats, value_label_names, variable_labels,
+ * characteristics, value_labels). The timestamp is not compared.
+ */
+std::vector<std::string> dtaDiffMeta(FILE * fa, const dtaHeader &a,
+                                     FILE * fb, const dtaHeader &b);
+
+/* Comparison of the observations of an old and a new file of the same
+ * layout. Both are read once side by side. Runs of dtaTileRows observations
+ * with the same bytes are skipped at once, the observations of the others
+ * are compared one by one. strLs are compared by a hash of their contents,
+ * read from <strls> before, so a strL moved to another (v,o) is the same.
+ *
+ * Without key observation j of the old file is compared with observation j of
+ * the new one. key are indices of variables both files are sorted by; then
+ * observations with the same key are compared, the first with the first of
+ * equal keys and so on. Observations of keys found in one file only are
+ * removed or added. An error is thrown if a file is not sorted by the key.
+ */
+class dtaDiff
+{
+public:
+  dtaDiff(FILE * fa, const dtaHeader &a, FILE * fb, const dtaHeader &b,
+          const std::vector<uint32_t> &key);
+
+  /* compares the next block, FALSE when all observations are compared */
+  bool step();
+
+  /* bytes of <data> of both files compared so far */
+  uint64_t done() const;
+
+  /* indices of the observations changed in the old and the new file, added
+   * to the new and removed from the old file
+   */
+  std::vector<uint64_t> changedOld, changedNew, added, removed;
+
+private:
+  int compareKey(const char * x, const char * y) const;
+  uint64_t strlHash(const std::vector< std::pair<uint64_t, uint64_t> > &t,
+                    const char * p) const;
+  bool sameRow(const char * x, const char * y) const;
+  bool dirtyRows(const char * x, uint64_t m) const;
+  void sorted(std::string &prev, const char * p, uint64_t m,
+              const char * file);
+  void nextOld();
+  void nextNew();
+
+  const dtaHeader &a, &b;
+  std::vector<uint32_t> key, strlcols;
+
+  /* (reference, hash) of the strLs of both files sorted by reference and the
+   * references of strLs that differ
+   */
+  std::vector< std::pair<uint64_t, uint64_t> > strlA, strlB;
+  std::vector<uint64_t> dirty;
+
+  dtaRowReader ra, rb;
+  std::string prevA, prevB;       // last keys of both files
+};
+
+#endif
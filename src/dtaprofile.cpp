@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2014-2015 Jan Marvin Garbuszus and Sebastian Jeworutzki
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+#include "dtaprofile.h"
+
+dtaProfile dtaProf;
+
+static double dtaWallTime()
+{
+#ifdef _WIN32
+  return GetTickCount64() / 1000.0;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+#endif
+}
+
+void dtaProfile::start(bool enable, const char * name)
+{
+  ph.clear();
+  on = enable;
+  if (on)
+    phase(name);
+}
+
+void dtaProfile::phase(const char * name)
+{
+  if (!on)
+    return;
+
+  double const now = dtaWallTime();
+  if (!ph.empty())
+    ph.back().seconds = now - since;
+  since = now;
+
+  dtaPhase p;
+  p.name = name;
+  p.seconds = 0;
+  p.bytes = p.calls = p.charsxp = p.buffer = 0;
+  ph.push_back(p);
+}
+
+void dtaProfile::stop()
+{
+  if (!on)
+    return;
+
+  if (!ph.empty())
+    ph.back().seconds = dtaWallTime() - since;
+  on = false;
+}
@@ -0,0 +1,74 @@
+#ifndef DTAPROFILE
+#define DTAPROFILE
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/* Counters of a read or a write by phase: wall time, bytes read or written,
+ * read, write and seek calls, CHARSXPs created and the largest buffer. A
+ * phase ends when the next one starts. Unless started enabled, counting is a
+ * single test of a flag.
+ */
+struct dtaPhase
+{
+  std::string name;
+  double seconds;
+  uint64_t bytes, calls, charsxp, buffer;
+};
+
+class dtaProfile
+{
+public:
+  dtaProfile() : on(false), since(0) {}
+
+  /* drops the previous profile and starts the first phase if enable */
+  void start(bool enable, const char * name);
+  void phase(const char * name);
+  void stop();
+
+  void io(uint64_t n)
+  {
+    if (on)
+    {
+      ph.back().bytes += n;
+      ++ph.back().calls;
+    }
+  }
+  void seek() { if (on) ++ph.back().calls; }
+  void charsxp(uint64_t n) { if (on) ph.back().charsxp += n; }
+  void buffer(uint64_t n)
+  {
+    if (on && n > ph.back().buffer)
+      ph.back().buffer = n;
+  }
+
+  const std::vector<dtaPhase> &phases() const { return ph; }
+
+private:
+  bool on;
+  double since;
+  std::vector<dtaPhase> ph;
+};
+
+/* profile of the last call of stata() or stataWrite() */
+extern dtaProfile dtaProf;
+
+/* Starts dtaProf and stops it when it goes out of scope, so a read or write
+ * that throws does not leave the profile running.
+ */
+class dtaProfileScope
+{
+public:
+  dtaProfileScope(bool enable, const char * name)
+  {
+    dtaProf.start(enable, name);
+  }
+  ~dtaProfileScope() { dtaProf.stop(); }
+
+private:
+  dtaProfileScope(const dtaProfileScope &);
+  dtaProfileScope &operator=(const dtaProfileScope &);
+};
+
+#endif
@@ -0,0 +1,796 @@
+/*
+ * Copyright (C) 2014-2015 Jan Marvin Garbuszus and Sebastian Jeworutzki
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Rcpp.h>
+#include <Rversion.h>
+#include <R_ext/Rdynload.h>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "readstata.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* ALTREP exists since R 3.5.0. Before R 3.6.0 Altrep.h uses class as a
+ * variable name and lacks C linkage.
+ */
+#if defined(R_VERSION) && R_VERSION >= R_Version(3, 5, 0)
+#define HAS_ALTREP
+#if R_VERSION < R_Version(3, 6, 0)
+#define class klass
+extern "C" {
+#include <R_ext/Altrep.h>
+}
+#undef class
+#else
+#include <R_ext/Altrep.h>
+#endif
+#endif
+
+using namespace Rcpp;
+using namespace std;
+
+/* An open dta-file shared by all lazy columns of a data.frame. It is closed
+ * once the last of them is garbage collected.
+ */
+struct dtaLazy
+{
+  FILE * file;
+  uint64_t offset;  // first byte of the first observation
+  uint64_t rowlen;  // bytes per observation
+  uint64_t n;       // number of observations
+  uint8_t release;
+  bool swapit;
+  bool missing;
+
+  std::vector<char> buf;
+
+  dtaLazy() : file(NULL), offset(0), rowlen(0), n(0), release(0), swapit(0),
+  missing(0) {}
+  ~dtaLazy() { if (file != NULL) fclose(file); }
+};
+
+SEXP dtaLazyFile(const char * filePath, uint64_t offset, uint64_t rowlen,
+                 uint64_t n, uint8_t release, bool swapit, bool missing)
+{
+  XPtr<dtaLazy> lz(new dtaLazy(), true);
+
+  if ((lz->file = fopen(filePath, "rb")) == NULL)
+    throw std::range_error("Could not open specified file.");
+
+  lz->offset = offset;
+  lz->rowlen = rowlen;
+  lz->n = n;
+  lz->release = release;
+  lz->swapit = swapit;
+  lz->missing = missing;
+
+  return lz;
+}
+
+/* A memory mapped sidecar file shared by its mapped columns */
+struct dtaMap
+{
+  char * addr;
+  size_t len;
+
+  dtaMap() : addr(NULL), len(0) {}
+#ifndef _WIN32
+  ~dtaMap() { if (addr != NULL) munmap(addr, len); }
+#endif
+};
+
+SEXP dtaMapFile(const char * filePath, uint64_t size)
+{
+  XPtr<dtaMap> map(new dtaMap(), true);
+
+#ifndef _WIN32
+  int fd = open(filePath, O_RDONLY);
+  if (fd < 0)
+    throw std::range_error("Could not open specified file.");
+
+  void * addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    throw std::range_error("Could not map specified file.");
+
+  map->addr = (char *)addr;
+  map->len = size;
+#else
+  throw std::range_error("Memory mapped files are not available.");
+#endif
+
+  return map;
+}
+
+#ifdef HAS_ALTREP
+
+static R_altrep_class_t dta13_real, dta13_integer, dta13_string;
+
+/*
+ * data1 of each lazy column is a list: the dtaLazy external pointer and a
+ * numeric vector with vartype and coloff. data2 holds the materialized
+ * vector once Dataptr was requested.
+ */
+
+static dtaLazy * lazyFile(SEXP x)
+{
+  return (dtaLazy*) R_ExternalPtrAddr(VECTOR_ELT(R_altrep_data1(x), 0));
+}
+
+static int32_t lazyType(SEXP x)
+{
+  return REAL(VECTOR_ELT(R_altrep_data1(x), 1))[0];
+}
+
+static uint64_t lazyColoff(SEXP x)
+{
+  return REAL(VECTOR_ELT(R_altrep_data1(x), 1))[1];
+}
+
+/* Copies the bytes of variable x for the observations [i, i+m) into out.
+ * Observations are read in blocks of about 1 MB.
+ */
+static void lazyBytes(SEXP x, R_xlen_t i, R_xlen_t m, char * out)
+{
+  dtaLazy * lz = lazyFile(x);
+  int32_t const width = dtaWidth(lazyType(x));
+  uint64_t const coloff = lazyColoff(x);
+
+  // a single value is read directly
+  if (m == 1)
+  {
+    dtaSeek(lz->file, lz->offset + i * lz->rowlen + coloff);
+    if (fread(out, width, 1, lz->file) != 1)
+      Rcpp::stop("lazy: a binary read error occurred");
+    return;
+  }
+
+  R_xlen_t block = (1 << 20) / lz->rowlen;
+  if (block < 1)
+    block = 1;
+  lz->buf.resize(block * lz->rowlen);
+
+  dtaSeek(lz->file, lz->offset + i * lz->rowlen);
+  for (R_xlen_t j = 0; j < m; j += block)
+  {
+    R_xlen_t const rows = (m - j < block) ? m - j : block;
+    if (fread(&lz->buf[0], lz->rowlen * rows, 1, lz->file) != 1)
+      Rcpp::stop("lazy: a binary read error occurred");
+
+    for (R_xlen_t r = 0; r < rows; ++r)
+      memcpy(out + (j + r) * width, &lz->buf[r * lz->rowlen + coloff], width);
+  }
+}
+
+/* decode observations [i, i+m) of a numeric variable */
+static void lazyReal(SEXP x, R_xlen_t i, R_xlen_t m, double * buf)
+{
+  dtaLazy * lz = lazyFile(x);
+  int32_t const type = lazyType(x), width = dtaWidth(type);
+
+  std::vector<char> bytes(m * width);
+  lazyBytes(x, i, m, &bytes[0]);
+
+  for (R_xlen_t j = 0; j < m; ++j)
+  {
+    const char * p = &bytes[j * width];
+    if (type == 65526)
+      buf[j] = dtaDouble(p, lz->swapit, lz->missing);
+    else
+      buf[j] = dtaFloat(p, lz->swapit, lz->missing);
+  }
+}
+
+/* decode observations [i, i+m) of an integer variable */
+static void lazyInt(SEXP x, R_xlen_t i, R_xlen_t m, int * buf)
+{
+  dtaLazy * lz = lazyFile(x);
+  int32_t const type = lazyType(x), width = dtaWidth(type);
+
+  std::vector<char> bytes(m * width);
+  lazyBytes(x, i, m, &bytes[0]);
+
+  for (R_xlen_t j = 0; j < m; ++j)
+  {
+    const char * p = &bytes[j * width];
+    switch(type)
+    {
+    case 65528: buf[j] = dtaLong(p, lz->swapit, lz->missing); break;
+    case 65529: buf[j] = dtaInt(p, lz->swapit, lz->missing); break;
+    case 65530: buf[j] = dtaByte(p, lz->swapit, lz->missing); break;
+    }
+  }
+}
+
+/* decode observations [i, i+m) of a string variable into out[start, ...) */
+static void lazyStr(SEXP x, R_xlen_t i, R_xlen_t m, SEXP out, R_xlen_t start)
+{
+  dtaLazy * lz = lazyFile(x);
+  int32_t const type = lazyType(x), width = dtaWidth(type);
+
+  std::vector<char> bytes(m * width);
+  lazyBytes(x, i, m, &bytes[0]);
+
+  for (R_xlen_t j = 0; j < m; ++j)
+  {
+    const char * p = &bytes[j * width];
+    if (type == 32768)
+      SET_STRING_ELT(out, start + j, dtaStrl(p, lz->release, lz->swapit));
+    else
+      SET_STRING_ELT(out, start + j, dtaStr(p, type));
+  }
+}
+
+/* Reads the full variable once and keeps it in data2 */
+static SEXP lazyMaterialize(SEXP x)
+{
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    return data2;
+
+  R_xlen_t const n = lazyFile(x)->n;
+  int32_t const type = lazyType(x);
+  R_xlen_t const chunk = 1 << 16;
+
+  switch(type < 2046 ? 2045 : type)
+  {
+  case 65526:
+  case 65527:
+    data2 = PROTECT(Rf_allocVector(REALSXP, n));
+    for (R_xlen_t i = 0; i < n; i += chunk)
+      lazyReal(x, i, (n - i < chunk) ? n - i : chunk, REAL(data2) + i);
+    break;
+  case 65528:
+  case 65529:
+  case 65530:
+    data2 = PROTECT(Rf_allocVector(INTSXP, n));
+    for (R_xlen_t i = 0; i < n; i += chunk)
+      lazyInt(x, i, (n - i < chunk) ? n - i : chunk, INTEGER(data2) + i);
+    break;
+  default:
+    data2 = PROTECT(Rf_allocVector(STRSXP, n));
+    for (R_xlen_t i = 0; i < n; i += chunk)
+      lazyStr(x, i, (n - i < chunk) ? n - i : chunk, data2, i);
+    break;
+  }
+
+  R_set_altrep_data2(x, data2);
+  UNPROTECT(1);
+  return data2;
+}
+
+/* methods shared by all classes */
+
+static R_xlen_t lazy_Length(SEXP x)
+{
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    return XLENGTH(data2);
+  return lazyFile(x)->n;
+}
+
+static Rboolean lazy_Inspect(SEXP x, int pre, int deep, int pvec,
+                             void (*inspect_subtree)(SEXP, int, int, int))
+{
+  Rprintf("dta13 lazy variable (type %d, %s)\n", lazyType(x),
+          R_altrep_data2(x) == R_NilValue ? "not materialized" :
+          "materialized");
+  return TRUE;
+}
+
+static void * lazy_Dataptr(SEXP x, Rboolean writeable)
+{
+  return DATAPTR(lazyMaterialize(x));
+}
+
+static const void * lazy_Dataptr_or_null(SEXP x)
+{
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 == R_NilValue)
+    return NULL;
+  return DATAPTR(data2);
+}
+
+/* numeric */
+
+static double real_Elt(SEXP x, R_xlen_t i)
+{
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    return REAL(data2)[i];
+
+  double val;
+  lazyReal(x, i, 1, &val);
+  return val;
+}
+
+static R_xlen_t real_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, double * buf)
+{
+  R_xlen_t const len = lazy_Length(x);
+  if (i + n > len)
+    n = len - i;
+
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    memcpy(buf, REAL(data2) + i, n * sizeof(double));
+  else
+    lazyReal(x, i, n, buf);
+  return n;
+}
+
+/* integer */
+
+static int integer_Elt(SEXP x, R_xlen_t i)
+{
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    return INTEGER(data2)[i];
+
+  int val;
+  lazyInt(x, i, 1, &val);
+  return val;
+}
+
+static R_xlen_t integer_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, int * buf)
+{
+  R_xlen_t const len = lazy_Length(x);
+  if (i + n > len)
+    n = len - i;
+
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    memcpy(buf, INTEGER(data2) + i, n * sizeof(int));
+  else
+    lazyInt(x, i, n, buf);
+  return n;
+}
+
+/* string */
+
+static SEXP string_Elt(SEXP x, R_xlen_t i)
+{
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    return STRING_ELT(data2, i);
+
+  SEXP val = PROTECT(Rf_allocVector(STRSXP, 1));
+  lazyStr(x, i, 1, val, 0);
+  UNPROTECT(1);
+  return STRING_ELT(val, 0);
+}
+
+static void string_Set_elt(SEXP x, R_xlen_t i, SEXP v)
+{
+  SET_STRING_ELT(lazyMaterialize(x), i, v);
+}
+
+/*
+ * Compact strings. data1 is a list: the raw vector with dtaWidth(vartype)
+ * bytes per value, a numeric vector with vartype, swapit and release and a
+ * small cache of the last CHARSXPs created with the index of each. data2
+ * holds the materialized vector once Dataptr or Set_elt was called.
+ */
+
+static R_altrep_class_t dta13_compact;
+
+static const R_xlen_t compactCache = 64;
+
+static SEXP compactMaterialize(SEXP x)
+{
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    return data2;
+
+  SEXP data1 = R_altrep_data1(x);
+  SEXP raw = VECTOR_ELT(data1, 0);
+  int32_t const type = REAL(VECTOR_ELT(data1, 1))[0];
+  bool const swapit = REAL(VECTOR_ELT(data1, 1))[1];
+  uint8_t const release = REAL(VECTOR_ELT(data1, 1))[2];
+  int32_t const width = dtaWidth(type);
+  R_xlen_t const n = XLENGTH(raw) / width;
+
+  data2 = PROTECT(Rf_allocVector(STRSXP, n));
+  for (R_xlen_t i = 0; i < n; ++i)
+  {
+    const char * p = (const char *)RAW(raw) + i * width;
+    if (type == 32768)
+      SET_STRING_ELT(data2, i, dtaStrl(p, release, swapit));
+    else
+      SET_STRING_ELT(data2, i, dtaStr(p, type));
+  }
+
+  R_set_altrep_data2(x, data2);
+  UNPROTECT(1);
+  return data2;
+}
+
+static R_xlen_t compact_Length(SEXP x)
+{
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    return XLENGTH(data2);
+
+  SEXP data1 = R_altrep_data1(x);
+  return XLENGTH(VECTOR_ELT(data1, 0)) /
+    dtaWidth(REAL(VECTOR_ELT(data1, 1))[0]);
+}
+
+static Rboolean compact_Inspect(SEXP x, int pre, int deep, int pvec,
+                                void (*inspect_subtree)(SEXP, int, int, int))
+{
+  Rprintf("dta13 compact string (type %d, %s)\n",
+          (int)REAL(VECTOR_ELT(R_altrep_data1(x), 1))[0],
+          R_altrep_data2(x) == R_NilValue ? "not materialized" :
+          "materialized");
+  return TRUE;
+}
+
+static void * compact_Dataptr(SEXP x, Rboolean writeable)
+{
+  return DATAPTR(compactMaterialize(x));
+}
+
+static SEXP compact_Elt(SEXP x, R_xlen_t i)
+{
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    return STRING_ELT(data2, i);
+
+  SEXP data1 = R_altrep_data1(x);
+  SEXP cache = VECTOR_ELT(data1, 2);
+  double * cached = REAL(VECTOR_ELT(data1, 3));
+  R_xlen_t const slot = i % compactCache;
+  if (cached[slot] == i)
+    return STRING_ELT(cache, slot);
+
+  int32_t const type = REAL(VECTOR_ELT(data1, 1))[0];
+  bool const swapit = REAL(VECTOR_ELT(data1, 1))[1];
+  uint8_t const release = REAL(VECTOR_ELT(data1, 1))[2];
+  const char * p = (const char *)RAW(VECTOR_ELT(data1, 0)) +
+    i * dtaWidth(type);
+
+  SEXP val = (type == 32768) ? dtaStrl(p, release, swapit) : dtaStr(p, type);
+  SET_STRING_ELT(cache, slot, val);
+  cached[slot] = i;
+  return val;
+}
+
+static void compact_Set_elt(SEXP x, R_xlen_t i, SEXP v)
+{
+  SET_STRING_ELT(compactMaterialize(x), i, v);
+}
+
+// strings in a dta-file are never missing
+static int compact_No_NA(SEXP x)
+{
+  return R_altrep_data2(x) == R_NilValue;
+}
+
+/*
+ * Mapped columns of a sidecar file. data1 is a list: the dtaMap external
+ * pointer and a numeric vector with kind (0 double, 1 integer, 2 string),
+ * width, offset and length. Numeric columns are used in place as long as
+ * they are only read, writing copies them into data2.
+ */
+
+static R_altrep_class_t dta13_mreal, dta13_minteger, dta13_mstring;
+
+static const char * mappedAddr(SEXP x)
+{
+  SEXP data1 = R_altrep_data1(x);
+  dtaMap * map = (dtaMap *) R_ExternalPtrAddr(VECTOR_ELT(data1, 0));
+  return map->addr + (uint64_t)REAL(VECTOR_ELT(data1, 1))[2];
+}
+
+static int32_t mappedWidth(SEXP x)
+{
+  return REAL(VECTOR_ELT(R_altrep_data1(x), 1))[1];
+}
+
+static SEXP mappedMaterialize(SEXP x)
+{
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    return data2;
+
+  R_xlen_t const n = REAL(VECTOR_ELT(R_altrep_data1(x), 1))[3];
+  const char * p = mappedAddr(x);
+
+  switch(TYPEOF(x))
+  {
+  case REALSXP:
+    data2 = PROTECT(Rf_allocVector(REALSXP, n));
+    memcpy(REAL(data2), p, n * sizeof(double));
+    break;
+  case INTSXP:
+    data2 = PROTECT(Rf_allocVector(INTSXP, n));
+    memcpy(INTEGER(data2), p, n * sizeof(int));
+    break;
+  default:
+  {
+    int32_t const width = mappedWidth(x);
+    data2 = PROTECT(Rf_allocVector(STRSXP, n));
+    for (R_xlen_t i = 0; i < n; ++i)
+      SET_STRING_ELT(data2, i, dtaStr(p + i * width, width));
+    break;
+  }
+  }
+
+  R_set_altrep_data2(x, data2);
+  UNPROTECT(1);
+  return data2;
+}
+
+static R_xlen_t mapped_Length(SEXP x)
+{
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    return XLENGTH(data2);
+  return REAL(VECTOR_ELT(R_altrep_data1(x), 1))[3];
+}
+
+static Rboolean mapped_Inspect(SEXP x, int pre, int deep, int pvec,
+                               void (*inspect_subtree)(SEXP, int, int, int))
+{
+  Rprintf("dta13 mapped variable (%s)\n",
+          R_altrep_data2(x) == R_NilValue ? "not materialized" :
+          "materialized");
+  return TRUE;
+}
+
+// numeric columns are only used in place for reading
+static void * mapped_Dataptr(SEXP x, Rboolean writeable)
+{
+  if (!writeable && TYPEOF(x) != STRSXP && R_altrep_data2(x) == R_NilValue)
+    return (void *)mappedAddr(x);
+  return DATAPTR(mappedMaterialize(x));
+}
+
+static const void * mapped_Dataptr_or_null(SEXP x)
+{
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    return DATAPTR(data2);
+  if (TYPEOF(x) == STRSXP)
+    return NULL;
+  return mappedAddr(x);
+}
+
+static double mreal_Elt(SEXP x, R_xlen_t i)
+{
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    return REAL(data2)[i];
+  return ((const double *)mappedAddr(x))[i];
+}
+
+static int minteger_Elt(SEXP x, R_xlen_t i)
+{
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    return INTEGER(data2)[i];
+  return ((const int *)mappedAddr(x))[i];
+}
+
+static SEXP mstring_Elt(SEXP x, R_xlen_t i)
+{
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue)
+    return STRING_ELT(data2, i);
+
+  int32_t const width = mappedWidth(x);
+  return dtaStr(mappedAddr(x) + i * width, width);
+}
+
+static void mstring_Set_elt(SEXP x, R_xlen_t i, SEXP v)
+{
+  SET_STRING_ELT(mappedMaterialize(x), i, v);
+}
+
+static void lazyMethods(R_altrep_class_t cls)
+{
+  R_set_altrep_Length_method(cls, lazy_Length);
+  R_set_altrep_Inspect_method(cls, lazy_Inspect);
+  R_set_altvec_Dataptr_method(cls, lazy_Dataptr);
+  R_set_altvec_Dataptr_or_null_method(cls, lazy_Dataptr_or_null);
+}
+
+void dtaInitAltrep(DllInfo * dll)
+{
+  dta13_real = R_make_altreal_class("dta13_real", "readstata13", dll);
+  lazyMethods(dta13_real);
+  R_set_altreal_Elt_method(dta13_real, real_Elt);
+  R_set_altreal_Get_region_method(dta13_real, real_Get_region);
+
+  dta13_integer = R_make_altinteger_class("dta13_integer", "readstata13", dll);
+  lazyMethods(dta13_integer);
+  R_set_altinteger_Elt_method(dta13_integer, integer_Elt);
+  R_set_altinteger_Get_region_method(dta13_integer, integer_Get_region);
+
+  dta13_string = R_make_altstring_class("dta13_string", "readstata13", dll);
+  lazyMethods(dta13_string);
+  R_set_altstring_Elt_method(dta13_string, string_Elt);
+  R_set_altstring_Set_elt_method(dta13_string, string_Set_elt);
+
+  dta13_compact = R_make_altstring_class("dta13_compact", "readstata13", dll);
+  R_set_altrep_Length_method(dta13_compact, compact_Length);
+  R_set_altrep_Inspect_method(dta13_compact, compact_Inspect);
+  R_set_altvec_Dataptr_method(dta13_compact, compact_Dataptr);
+  R_set_altvec_Dataptr_or_null_method(dta13_compact, lazy_Dataptr_or_null);
+  R_set_altstring_Elt_method(dta13_compact, compact_Elt);
+  R_set_altstring_Set_elt_method(dta13_compact, compact_Set_elt);
+  R_set_altstring_No_NA_method(dta13_compact, compact_No_NA);
+
+  dta13_mreal = R_make_altreal_class("dta13_mreal", "readstata13", dll);
+  dta13_minteger = R_make_altinteger_class("dta13_minteger", "readstata13",
+                                           dll);
+  dta13_mstring = R_make_altstring_class("dta13_mstring", "readstata13", dll);
+
+  R_altrep_class_t mapped[3] = {dta13_mreal, dta13_minteger, dta13_mstring};
+  for (int i = 0; i < 3; ++i)
+  {
+    R_set_altrep_Length_method(mapped[i], mapped_Length);
+    R_set_altrep_Inspect_method(mapped[i], mapped_Inspect);
+    R_set_altvec_Dataptr_method(mapped[i], mapped_Dataptr);
+    R_set_altvec_Dataptr_or_null_method(mapped[i], mapped_Dataptr_or_null);
+  }
+  R_set_altreal_Elt_method(dta13_mreal, mreal_Elt);
+  R_set_altinteger_Elt_method(dta13_minteger, minteger_Elt);
+  R_set_altstring_Elt_method(dta13_mstring, mstring_Elt);
+  R_set_altstring_Set_elt_method(dta13_mstring, mstring_Set_elt);
+  R_set_altstring_No_NA_method(dta13_mstring, compact_No_NA);
+}
+
+bool dtaLazyAvailable()
+{
+  return true;
+}
+
+SEXP dtaLazyColumn(SEXP lazyfile, int32_t vartype, uint64_t coloff)
+{
+  SEXP data1 = PROTECT(Rf_allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(data1, 0, lazyfile);
+  SEXP info = Rf_allocVector(REALSXP, 2);
+  SET_VECTOR_ELT(data1, 1, info);
+  REAL(info)[0] = vartype;
+  REAL(info)[1] = coloff;
+
+  SEXP res;
+  switch(vartype < 2046 ? 2045 : vartype)
+  {
+  case 65526:
+  case 65527:
+    res = R_new_altrep(dta13_real, data1, R_NilValue);
+    break;
+  case 65528:
+  case 65529:
+  case 65530:
+    res = R_new_altrep(dta13_integer, data1, R_NilValue);
+    break;
+  default:
+    res = R_new_altrep(dta13_string, data1, R_NilValue);
+    break;
+  }
+
+  UNPROTECT(1);
+  return res;
+}
+
+SEXP dtaCompactString(SEXP raw, int32_t vartype, uint8_t release, bool swapit)
+{
+  SEXP data1 = PROTECT(Rf_allocVector(VECSXP, 4));
+  SET_VECTOR_ELT(data1, 0, raw);
+  SEXP info = Rf_allocVector(REALSXP, 3);
+  SET_VECTOR_ELT(data1, 1, info);
+  REAL(info)[0] = vartype;
+  REAL(info)[1] = swapit;
+  REAL(info)[2] = release;
+  SET_VECTOR_ELT(data1, 2, Rf_allocVector(STRSXP, compactCache));
+  SEXP cached = Rf_allocVector(REALSXP, compactCache);
+  SET_VECTOR_ELT(data1, 3, cached);
+  for (R_xlen_t i = 0; i < compactCache; ++i)
+    REAL(cached)[i] = -1;
+
+  SEXP res = R_new_altrep(dta13_compact, data1, R_NilValue);
+  UNPROTECT(1);
+  return res;
+}
+
+bool dtaMapAvailable()
+{
+#ifndef _WIN32
+  return true;
+#else
+  return false;
+#endif
+}
+
+SEXP dtaMappedColumn(SEXP map, int32_t kind, int32_t width, uint64_t offset,
+                     uint64_t n)
+{
+  SEXP data1 = PROTECT(Rf_allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(data1, 0, map);
+  SEXP info = Rf_allocVector(REALSXP, 4);
+  SET_VECTOR_ELT(data1, 1, info);
+  REAL(info)[0] = kind;
+  REAL(info)[1] = width;
+  REAL(info)[2] = offset;
+  REAL(info)[3] = n;
+
+  SEXP res;
+  switch(kind)
+  {
+  case 0:
+    res = R_new_altrep(dta13_mreal, data1, R_NilValue);
+    break;
+  case 1:
+    res = R_new_altrep(dta13_minteger, data1, R_NilValue);
+    break;
+  default:
+    res = R_new_altrep(dta13_mstring, data1, R_NilValue);
+    break;
+  }
+
+  UNPROTECT(1);
+  return res;
+}
+
+#else
+
+void dtaInitAltrep(DllInfo * dll) {}
+
+bool dtaLazyAvailable()
+{
+  return false;
+}
+
+SEXP dtaLazyColumn(SEXP lazyfile, int32_t vartype, uint64_t coloff)
+{
+  Rcpp::stop("Lazy variables require R >= 3.5.0.");
+  return R_NilValue;
+}
+
+SEXP dtaCompactString(SEXP raw, int32_t vartype, uint8_t release, bool swapit)
+{
+  Rcpp::stop("Compact strings require R >= 3.5.0.");
+  return R_NilValue;
+}
+
+bool dtaMapAvailable()
+{
+  return false;
+}
+
+SEXP dtaMappedColumn(SEXP map, int32_t kind, int32_t width, uint64_t offset,
+                     uint64_t n)
+{
+  Rcpp::stop("Mapped variables require R >= 3.5.0.");
+  return R_NilValue;
+}
+
+#endif
+
+// Registers the ALTREP classes when the package is loaded.
+extern "C" void R_init_readstata13(DllInfo * dll)
+{
+  dtaInitAltrep(dll);
+}
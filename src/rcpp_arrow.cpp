@@ -0,0 +1,594 @@
+/*
+ * Copyright (C) 2014-2015 Jan Marvin Garbuszus and Sebastian Jeworutzki
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Rcpp.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include <stdlib.h>
+#include "readstata.h"
+#include "arrowabi.h"
+
+using namespace Rcpp;
+using namespace std;
+
+/*
+ * Export of a dta-file through the Arrow C data interface. The observations
+ * are decoded by the core (dtacore.h) into a sink that writes each variable
+ * straight into the buffers of its Arrow array; the data is not read into R.
+ * Stata missings are null. Every variable keeps the width it has in the
+ * dta-file.
+ */
+
+/* private_data of an ArrowArray: the buffers and children it owns */
+struct arrowArrayData
+{
+  std::vector< std::vector<char> > bufs;
+  std::vector<const void*> ptrs;
+  std::vector<ArrowArray*> children;
+};
+
+/* private_data of an ArrowSchema: the strings and children it owns */
+struct arrowSchemaData
+{
+  std::string format;
+  std::string name;
+  std::vector<ArrowSchema*> children;
+};
+
+static void releaseArray(ArrowArray * array)
+{
+  arrowArrayData * d = (arrowArrayData *)array->private_data;
+
+  for (size_t i = 0; i < d->children.size(); ++i)
+  {
+    if (d->children[i]->release != NULL)
+      d->children[i]->release(d->children[i]);
+    delete d->children[i];
+  }
+  if (array->dictionary != NULL)
+  {
+    if (array->dictionary->release != NULL)
+      array->dictionary->release(array->dictionary);
+    delete array->dictionary;
+  }
+
+  delete d;
+  array->release = NULL;
+}
+
+static void releaseSchema(ArrowSchema * schema)
+{
+  arrowSchemaData * d = (arrowSchemaData *)schema->private_data;
+
+  for (size_t i = 0; i < d->children.size(); ++i)
+  {
+    if (d->children[i]->release != NULL)
+      d->children[i]->release(d->children[i]);
+    delete d->children[i];
+  }
+  if (schema->dictionary != NULL)
+  {
+    if (schema->dictionary->release != NULL)
+      schema->dictionary->release(schema->dictionary);
+    delete schema->dictionary;
+  }
+
+  delete d;
+  schema->release = NULL;
+}
+
+static void initSchema(ArrowSchema * schema, std::string format,
+                       std::string name)
+{
+  arrowSchemaData * d = new arrowSchemaData();
+  d->format = format;
+  d->name = name;
+
+  schema->format = d->format.c_str();
+  schema->name = d->name.c_str();
+  schema->metadata = NULL;
+  schema->flags = ARROW_FLAG_NULLABLE;
+  schema->n_children = 0;
+  schema->children = NULL;
+  schema->dictionary = NULL;
+  schema->release = releaseSchema;
+  schema->private_data = d;
+}
+
+/* buffers are moved into the array. A missing validity buffer is passed as
+ * an empty vector. Other buffers must not be NULL, even if empty.
+ */
+static void initArray(ArrowArray * array, int64_t length, int64_t nulls,
+                      std::vector< std::vector<char> > & bufs)
+{
+  arrowArrayData * d = new arrowArrayData();
+  d->bufs.resize(bufs.size());
+  d->ptrs.resize(bufs.size());
+  for (size_t i = 0; i < bufs.size(); ++i)
+  {
+    d->bufs[i].swap(bufs[i]);
+    if (i > 0 && d->bufs[i].empty())
+      d->bufs[i].resize(1);
+    d->ptrs[i] = d->bufs[i].empty() ? NULL : &d->bufs[i][0];
+  }
+
+  array->length = length;
+  array->null_count = nulls;
+  array->offset = 0;
+  array->n_buffers = d->ptrs.size();
+  array->n_children = 0;
+  array->buffers = d->ptrs.empty() ? NULL : &d->ptrs[0];
+  array->children = NULL;
+  array->dictionary = NULL;
+  array->release = releaseArray;
+  array->private_data = d;
+}
+
+/* validity bitmap. Bits are set for valid values. */
+class arrowBitmap
+{
+public:
+  arrowBitmap(int64_t n = 0) : bits((n + 7) / 8, 0), nulls(0) {}
+  void set(int64_t i, bool valid)
+  {
+    if (valid)
+      bits[i / 8] |= (char)(1 << (i % 8));
+    else
+      ++nulls;
+  }
+
+  std::vector<char> bits;
+  int64_t nulls;
+};
+
+/* buffers of a variable while it is decoded. Fixed width values are stored
+ * at their position, strings are appended to data and values holds their
+ * 64 bit offsets.
+ */
+struct arrowColumn
+{
+  int32_t type;
+  std::vector<char> values;
+  std::vector<char> data;
+  arrowBitmap valid;
+
+  /* labelled integers are stored as index into dict */
+  bool labelled;
+  std::map<int32_t, int32_t> index;
+  std::vector<std::string> dict;
+
+  arrowColumn() : type(0), labelled(false) {}
+};
+
+/* label set of a dta-file: codes and label texts */
+struct arrowLabels
+{
+  std::vector<int32_t> code;
+  std::vector<std::string> text;
+};
+
+/*
+ * Sink of the decoder (dtacore.h) writing the values into the buffers of the
+ * Arrow arrays. Codes of labelled integers without label are added to the
+ * dictionary when they are first seen.
+ */
+class arrowSink : public dtaSink
+{
+public:
+  arrowSink(std::vector<arrowColumn> &cols,
+            const std::map<uint64_t, std::string> &strl) :
+  cols(cols), strl(strl) {}
+
+  void doubles(uint32_t i, uint64_t first, uint64_t m, const double * val,
+               const int8_t * na)
+  {
+    arrowColumn &c = cols[i];
+    if (c.type == 65526)
+      store<double>(c, first, m, val, na);
+    else
+      store<float>(c, first, m, val, na);
+  }
+
+  void ints(uint32_t i, uint64_t first, uint64_t m, const int32_t * val,
+            const int8_t * na)
+  {
+    arrowColumn &c = cols[i];
+    if (c.labelled)
+    {
+      for (uint64_t j = 0; j < m; ++j)
+      {
+        int32_t idx = 0;
+        if (na[j] < 0)
+        {
+          std::map<int32_t, int32_t>::iterator it = c.index.find(val[j]);
+          if (it == c.index.end())
+          {
+            char code[12];
+            snprintf(code, sizeof code, "%d", val[j]);
+            it = c.index.insert(std::make_pair(val[j],
+                                               (int32_t)c.dict.size())).first;
+            c.dict.push_back(code);
+          }
+          idx = it->second;
+        }
+        c.valid.set(first + j, na[j] < 0);
+        memcpy(&c.values[(first + j) * 4], &idx, 4);
+      }
+      return;
+    }
+
+    switch(c.type)
+    {
+    case 65528: store<int32_t>(c, first, m, val, na); break;
+    case 65529: store<int16_t>(c, first, m, val, na); break;
+    default:    store<int8_t>(c, first, m, val, na);  break;
+    }
+  }
+
+  void strings(uint32_t i, uint64_t first, uint64_t m, const char * val,
+               int32_t width)
+  {
+    arrowColumn &c = cols[i];
+    for (uint64_t j = 0; j < m; ++j)
+    {
+      const char * p = val + j * width;
+      int32_t len = 0;
+      while (len < width && p[len] != '\0')
+        ++len;
+      append(c, first + j, p, len);
+    }
+  }
+
+  void strls(uint32_t i, uint64_t first, uint64_t m, const uint64_t * ref)
+  {
+    arrowColumn &c = cols[i];
+    for (uint64_t j = 0; j < m; ++j)
+    {
+      // 0 is an empty strL
+      std::map<uint64_t, std::string>::const_iterator it =
+        strl.find(ref[j]);
+      if (it == strl.end())
+        append(c, first + j, NULL, 0);
+      else
+        append(c, first + j, it->second.data(), it->second.size());
+    }
+  }
+
+private:
+  template <typename T, typename V>
+  void store(arrowColumn &c, uint64_t first, uint64_t m, const V * val,
+             const int8_t * na)
+  {
+    for (uint64_t j = 0; j < m; ++j)
+    {
+      bool const ok = na[j] < 0 && !dtaIsNaN(val[j]);
+      T const t = ok ? (T)val[j] : 0;
+      c.valid.set(first + j, ok);
+      memcpy(&c.values[(first + j) * sizeof(T)], &t, sizeof(T));
+    }
+  }
+
+  /* appends the string of observation j and stores the offset of its end */
+  void append(arrowColumn &c, uint64_t j, const char * p, size_t len)
+  {
+    c.data.insert(c.data.end(), p, p + len);
+    int64_t const end = c.data.size();
+    memcpy(&c.values[(j + 1) * 8], &end, 8);
+  }
+
+  std::vector<arrowColumn> &cols;
+  const std::map<uint64_t, std::string> &strl;
+};
+
+/* fixed width or dictionary array. values and validity are moved. */
+static void numericArray(ArrowArray * array, int64_t n,
+                         std::vector<char> & values, arrowBitmap & valid)
+{
+  std::vector< std::vector<char> > bufs(2);
+  if (valid.nulls > 0)
+    bufs[0].swap(valid.bits);
+  bufs[1].swap(values);
+
+  initArray(array, n, valid.nulls, bufs);
+}
+
+/* utf8 or binary array of n strings from their bytes in data and the 64 bit
+ * offsets of their ends. Offsets are narrowed to 32 bit in place if the data
+ * fits.
+ */
+static std::string stringArray(ArrowArray * array, int64_t n,
+                               std::vector<char> & offsets,
+                               std::vector<char> & data, bool utf8)
+{
+  bool const large = data.size() > 2147483647;
+
+  if (!large)
+  {
+    for (int64_t i = 0; i <= n; ++i)
+    {
+      int64_t pos;
+      memcpy(&pos, &offsets[i * 8], 8);
+      int32_t const pos32 = pos;
+      memcpy(&offsets[i * 4], &pos32, 4);
+    }
+    offsets.resize((n + 1) * 4);
+  }
+
+  std::vector< std::vector<char> > bufs(3);
+  bufs[1].swap(offsets);
+  bufs[2].swap(data);
+  initArray(array, n, 0, bufs);
+
+  if (utf8)
+    return large ? "U" : "u";
+  return large ? "Z" : "z";
+}
+
+/* dictionary of a labelled integer variable: the labels followed by the
+ * codes without label
+ */
+static void dictArray(ArrowArray * array, ArrowSchema * schema,
+                      const std::vector<std::string> &dict, bool utf8)
+{
+  int64_t const n = dict.size();
+  std::vector<char> offsets((n + 1) * 8, 0), data;
+  for (int64_t i = 0; i < n; ++i)
+  {
+    data.insert(data.end(), dict[i].begin(), dict[i].end());
+    int64_t const end = data.size();
+    memcpy(&offsets[(i + 1) * 8], &end, 8);
+  }
+
+  array->dictionary = new ArrowArray();
+  std::string format = stringArray(array->dictionary, n, offsets, data, utf8);
+  schema->dictionary = new ArrowSchema();
+  initSchema(schema->dictionary, format, "");
+}
+
+/* k fields of len bytes starting at pos, each up to its binary 0 */
+static std::vector<std::string> arrowFields(FILE * file, uint64_t pos,
+                                            uint32_t k, int len)
+{
+  std::vector<std::string> res(k);
+  std::string field(len, '\0');
+
+  dtaSeek(file, pos);
+  for (uint32_t i = 0; i < k; ++i)
+  {
+    readstring(field, file, len);
+    res[i] = field.c_str();
+  }
+  return res;
+}
+
+/* label sets of <value_labels> by their names. A label ends at its binary 0.
+ */
+static void arrowReadLabels(FILE * file, const dtaHeader &h,
+                            std::map<std::string, arrowLabels> &labels)
+{
+  dtaSeek(file, h.map[11] + 14); // <value_labels>
+
+  std::string tag(5, '\0');
+  readstring(tag, file, tag.size());
+
+  while (tag == "<lbl>")
+  {
+    readbin((int32_t)0, file, h.swapit); // nlen
+    std::string labname(h.lbllen, '\0');
+    readstring(labname, file, labname.size());
+    dtaSkip(file, 3); // padding
+
+    int32_t const labn = std::max(readbin((int32_t)0, file, h.swapit), 0);
+    int32_t const txtlen = std::max(readbin((int32_t)0, file, h.swapit), 0);
+
+    std::string tab(8 * (uint64_t)labn, '\0'), txt(txtlen, '\0');
+    if (labn > 0)
+      readstring(tab, file, tab.size());
+    if (txtlen > 0)
+      readstring(txt, file, txtlen);
+
+    arrowLabels &lab = labels[labname.c_str()];
+    lab = arrowLabels();
+    for (int32_t i = 0; i < labn; ++i)
+    {
+      int32_t const off = loadbin<int32_t>(&tab[4 * i], h.swapit);
+      lab.code.push_back(loadbin<int32_t>(&tab[4 * (labn + i)], h.swapit));
+      if (off < 0 || off >= txtlen)
+      {
+        lab.text.push_back("");
+        continue;
+      }
+      size_t end = txt.find('\0', off);
+      if (end == std::string::npos)
+        end = txtlen;
+      lab.text.push_back(txt.substr(off, end - off));
+    }
+
+    dtaSkip(file, 6); // </lbl>
+    readstring(tag, file, tag.size());
+  }
+}
+
+/* contents of the strLs in <strls> by their reference (see dtaStrlRef in dtacore.h). The
+ * binary 0 ending strLs of type 130 is dropped.
+ */
+static void arrowReadStrls(FILE * file, const dtaHeader &h,
+                           std::map<uint64_t, std::string> &strl)
+{
+  dtaSeek(file, h.map[10] + 7); // <strls>
+
+  std::string tags(3, '\0'), gsohead(dtaGsoSize(h.release), '\0');
+  readstring(tags, file, tags.size());
+
+  while (tags == "GSO")
+  {
+    readstring(gsohead, file, gsohead.size());
+    dtaGso g;
+    dtaDecodeGso(gsohead.data(), h.release, h.swapit, g);
+
+    std::string &val = strl[g.ref];
+    val.assign(g.len, '\0');
+    if (g.len > 0)
+      readstring(val, file, g.len);
+    if (g.t == 130 && g.len > 0 && val[g.len - 1] == '\0')
+      val.resize(g.len - 1);
+
+    readstring(tags, file, tags.size());
+  }
+}
+
+static void * arrowAddress(SEXP ptr)
+{
+  switch(TYPEOF(ptr))
+  {
+  case EXTPTRSXP:
+    return R_ExternalPtrAddr(ptr);
+  case REALSXP:
+    return (void *)(uintptr_t)REAL(ptr)[0];
+  case STRSXP:
+    return (void *)(uintptr_t)strtoull(CHAR(STRING_ELT(ptr, 0)), NULL, 10);
+  }
+  throw std::range_error("Address of Arrow struct is not valid.");
+}
+
+// Export a dta-file to the Arrow C data interface
+//
+// @param filePath path of the dta-file.
+// @param schema address of an allocated ArrowSchema.
+// @param array address of an allocated ArrowArray.
+// @return number of rows exported
+// [[Rcpp::export]]
+double stataArrow(const char * filePath, SEXP schema, SEXP array)
+{
+  ArrowSchema * s = (ArrowSchema *)arrowAddress(schema);
+  ArrowArray * a = (ArrowArray *)arrowAddress(array);
+  if (s == NULL || a == NULL)
+    throw std::range_error("Address of Arrow struct is not valid.");
+
+  dtaFile file(filePath, "rb");
+  if (file == NULL)
+    throw std::range_error("Could not open specified file.");
+
+  dtaHeader h;
+  dtaReadHeader(file, h);
+
+  uint32_t const k = h.k;
+  int64_t const n = h.n;
+
+  // dta 117 stores CP1252 strings which are exported as binary
+  bool const utf8 = h.release >= 118;
+
+  std::vector<std::string> const names =
+    arrowFields(file, h.map[3] + 10, k, h.nvarnameslen); // <varnames>
+  std::vector<std::string> const valLabels =
+    arrowFields(file, h.map[6] + 19, k, h.nvalLabelslen); // <value_label_names>
+
+  std::map<std::string, arrowLabels> labels;
+  arrowReadLabels(file, h, labels);
+  std::map<uint64_t, std::string> strl;
+  arrowReadStrls(file, h, strl);
+
+  // buffers of all observations, filled by the sink
+  std::vector<arrowColumn> cols(k);
+  for (uint32_t i = 0; i < k; ++i)
+  {
+    arrowColumn &c = cols[i];
+    int32_t const type = h.vartype[i];
+    c.type = type;
+
+    std::map<std::string, arrowLabels>::const_iterator lab =
+      labels.find(valLabels[i]);
+
+    if (type <= 2045 || type == 32768)
+    {
+      c.values.assign((n + 1) * 8, 0);
+      continue;
+    }
+
+    c.valid = arrowBitmap(n);
+    if (type >= 65528 && !valLabels[i].empty() && lab != labels.end())
+    {
+      // labelled integers
+      c.labelled = true;
+      for (size_t l = 0; l < lab->second.code.size(); ++l)
+      {
+        if (c.index.insert(std::make_pair(lab->second.code[l],
+                                          (int32_t)c.dict.size())).second)
+          c.dict.push_back(lab->second.text[l]);
+      }
+      c.values.resize(n * 4);
+    } else {
+      c.values.resize(n * dtaWidth(type));
+    }
+  }
+
+  arrowSink sink(cols, strl);
+  dtaReadData(file, h, sink);
+  file.close();
+
+  std::vector< std::vector<char> > nobufs(1);
+  initArray(a, n, 0, nobufs);
+  initSchema(s, "+s", "");
+  s->flags = 0;
+
+  arrowArrayData * ad = (arrowArrayData *)a->private_data;
+  arrowSchemaData * sd = (arrowSchemaData *)s->private_data;
+
+  for (uint32_t i = 0; i < k; ++i)
+  {
+    arrowColumn &c = cols[i];
+
+    ArrowArray * child = new ArrowArray();
+    ad->children.push_back(child);
+    ArrowSchema * childSchema = new ArrowSchema();
+    sd->children.push_back(childSchema);
+
+    std::string format;
+    switch(c.type < 2046 ? 2045 : c.type)
+    {
+    case 65526: format = "g"; break;
+    case 65527: format = "f"; break;
+    case 65528: format = "i"; break;
+    case 65529: format = "s"; break;
+    case 65530: format = "c"; break;
+    }
+
+    if (format.empty())
+      format = stringArray(child, n, c.values, c.data, utf8);
+    else
+      numericArray(child, n, c.values, c.valid);
+
+    initSchema(childSchema, "", names[i]);
+    if (c.labelled)
+    {
+      format = "i";
+      dictArray(child, childSchema, c.dict, utf8);
+    }
+    ((arrowSchemaData *)childSchema->private_data)->format = format;
+    childSchema->format =
+      ((arrowSchemaData *)childSchema->private_data)->format.c_str();
+  }
+
+  a->n_children = k;
+  a->children = ad->children.empty() ? NULL : &ad->children[0];
+  s->n_children = k;
+  s->children = sd->children.empty() ? NULL : &sd->children[0];
+
+  return n;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2014-2015 Jan Marvin Garbuszus and Sebastian Jeworutzki
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Rcpp.h>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "readstata.h"
+
+using namespace Rcpp;
+using namespace std;
+
+// 1-based indices of observations for R
+static NumericVector diffIndex(const vector<uint64_t> &x)
+{
+  NumericVector res(x.size());
+  for (size_t i = 0; i < x.size(); ++i)
+    res[i] = (double)x[i] + 1;
+  return res;
+}
+
+// Compare two dta-files
+//
+// @param oldPath path to the old dta file
+// @param newPath path to the new dta file
+// @param key names of the variables both files are sorted by
+// @return list of the changed (data.frame of the indices in old and new),
+// added and removed observations and the differing parts of the metadata.
+// Observations are NULL if the variables of the files differ.
+// [[Rcpp::export]]
+List stataDiff(const char * oldPath, const char * newPath,
+               CharacterVector key)
+{
+  dtaFile fa(oldPath, "rb"), fb(newPath, "rb");
+  if (fa == NULL || fb == NULL)
+    throw std::range_error("Could not open specified file.");
+
+  dtaHeader a, b;
+  dtaReadHeader(fa, a);
+  dtaReadHeader(fb, b);
+
+  vector<string> const meta = dtaDiffMeta(fa, a, fb, b);
+
+  List res(4);
+  res[3] = wrap(meta);
+  res.attr("names") = CharacterVector::create("changed", "added", "removed",
+                                              "metadata");
+  if (!dtaSameLayout(a, b))
+    return res;
+
+  // key variables by their names in the old file
+  vector<uint32_t> keyvars;
+  if (key.size() > 0)
+  {
+    dtaSeek(fa, a.map[3] + 10); // <varnames>
+    vector<string> varnames(a.k);
+    string name(a.nvarnameslen, '\0');
+    for (uint32_t i = 0; i < a.k; ++i)
+    {
+      readstring(name, fa, name.size());
+      varnames[i] = name.c_str();
+    }
+
+    for (R_xlen_t j = 0; j < key.size(); ++j)
+    {
+      string const var = as<string>(key[j]);
+      uint32_t i = 0;
+      while (i < a.k && varnames[i] != var)
+        ++i;
+      if (i == a.k)
+        throw std::range_error("Key variable " + var + " not found.");
+      keyvars.push_back(i);
+    }
+  }
+
+  dtaDiff diff(fa, a, fb, b, keyvars);
+
+  dtaProgress progress("comparing data", (a.n + b.n) * a.rowlen);
+  uint64_t done = 0;
+  while (diff.step())
+  {
+    progress.add(diff.done() - done);
+    done = diff.done();
+  }
+  progress.finish();
+
+  List changed(2);
+  changed[0] = diffIndex(diff.changedOld);
+  changed[1] = diffIndex(diff.changedNew);
+  changed.attr("names") = CharacterVector::create("old", "new");
+  changed.attr("row.names") = IntegerVector::create(NA_INTEGER,
+                                -(int)diff.changedOld.size());
+  changed.attr("class") = "data.frame";
+
+  res[0] = changed;
+  res[1] = diffIndex(diff.added);
+  res[2] = diffIndex(diff.removed);
+  return res;
+}
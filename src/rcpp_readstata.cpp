@@ -18,36 +18,13 @@
 #include <Rcpp.h>
 #include "string"
 #include <stdint.h>
-#include "statadefines.h"
-#include "swap_endian.h"
+#include <set>
+#include <sys/stat.h>
+#include "readstata.h"
 
 using namespace Rcpp;
 using namespace std;
 
-/* Test for a little-endian machine */
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-#define lsf "LSF"
-#else
-#define lsf "MSF"
-#endif
-
-template <typename T>
-T readbin( T t , FILE * file, bool swapit)
-{
-  if (fread(&t, sizeof(t), 1, file) != 1)
-    Rcpp::warning("num: a binary read error occurred");
-  if (swapit==0)
-    return(t);
-  else
-    return(swap_endian(t));
-}
-
-static void readstring(std::string &mystring, FILE * fp, int nchar)
-{
-  if (!fread(&mystring[0], nchar, 1, fp))
-    Rcpp::warning("char: a binary read error occurred");
-}
-
 void test(std::string testme, FILE * file)
 {
   std::string test(testme.size(), '\0');
@@ -59,233 +36,521 @@ void test(std::string testme, FILE * file)
   }
 }
 
-// Reads the binary Stata file
-//
-// @param filePath The full systempath to the dta file you want to import.
-// @param missing logical if missings should be converted outside of Rcpp.
-// @import Rcpp
-// @export
-// [[Rcpp::export]]
-List stata(const char * filePath, const bool missing)
+/*
+ * Keyed lookup in a sorted file. The sort variables of an observation are read
+ * directly from the file and compared to the key. Missings are sorted after
+ * all values as in Stata, strings bytewise.
+ */
+struct dtaKey
 {
-  FILE *file = NULL;    // File pointer
-
-  /*
-  * Open the file in binary mode using the "rb" format string
-  * This also checks if the file exists and/or can be opened for reading correctly
-  */
+  FILE * file;
+  uint64_t data;                  // first byte of the first observation
+  uint64_t rowlen;
+  bool swapit;
+  std::vector<int32_t> types;     // type of each sort variable
+  std::vector<uint64_t> coloff;   // offset of each sort variable
+  std::vector<double> num;        // key of numeric sort variables
+  std::vector<std::string> str;   // key of string sort variables
+  std::string buf;
+};
+
+// compares observation row with the key. Returns <0, 0 or >0.
+static int dtaKeyCompare(dtaKey &key, uint64_t row)
+{
+  for (size_t i = 0; i < key.types.size(); ++i)
+  {
+    int32_t const type = key.types[i];
+    int32_t const width = dtaWidth(type);
+    key.buf.resize(width);
 
-  if ((file = fopen(filePath, "rb")) == NULL)
-    throw std::range_error("Could not open specified file.");
+    dtaSeek(key.file, key.data + row * key.rowlen + key.coloff[i]);
+    readstring(key.buf, key.file, width);
+    const char * p = &key.buf[0];
 
-  /*
-  * check the first byte. continue if "<"
-  */
+    if (type <= 2045)
+    {
+      // strings end at the first binary 0
+      std::string val(p, width);
+      val.resize(strlen(val.c_str()));
+      int const cmp = val.compare(key.str[i]);
+      if (cmp != 0)
+        return cmp;
+      continue;
+    }
 
-  std::string fbit(1, '\0');
-  readstring(fbit, file, fbit.size());
+    double val = NA_REAL;
+    switch(type)
+    {
+    case 65526: val = dtaDouble(p, key.swapit, 0); break;
+    case 65527: val = dtaFloat(p, key.swapit, 0); break;
+    case 65528: val = dtaLong(p, key.swapit, 0); break;
+    case 65529: val = dtaInt(p, key.swapit, 0); break;
+    case 65530: val = dtaByte(p, key.swapit, 0); break;
+    }
+    if (type != 65526 && type != 65527 && val == NA_INTEGER)
+      val = NA_REAL;
 
-  std::string expfbit = "<";
+    bool const valna = ISNAN(val), keyna = ISNAN(key.num[i]);
+    if (valna || keyna)
+    {
+      if (valna && keyna)
+        continue;
+      return valna ? 1 : -1;
+    }
+    if (val != key.num[i])
+      return val < key.num[i] ? -1 : 1;
+  }
+  return 0;
+}
 
-  if (fbit.compare(expfbit)!=0)
-    Rcpp::stop("First byte: Not a version 13/14 dta-file.");
+/*
+ * Filters of observations. A filter is compiled in R into a nested list of
+ * nodes: list(op = "and"/"or", args = list(...)) or a comparison
+ * list(op = "==", var = "name", value = ...). Comparisons with a missing
+ * are false, strings are compared bytewise.
+ */
+struct dtaFilter
+{
+  enum { AND, OR, EQ, NE, LT, LE, GT, GE, IN };
+
+  int op;
+  int32_t type;
+  uint64_t coloff;
+  double num;
+  std::string str;
+  std::set<double> nums;
+  std::set<std::string> strs;
+  std::vector<dtaFilter> args;
+};
+
+static dtaFilter dtaCompileFilter(List node, CharacterVector varnames,
+                                  IntegerVector vartype,
+                                  const std::vector<uint64_t> &coloff,
+                                  uint8_t release)
+{
+  dtaFilter f;
+  const string op = as<string>(node["op"]);
 
-  fseek(file, 18, SEEK_CUR);// stata_dta><header>
-  test("<release>", file);
+  if (op == "and" || op == "or")
+  {
+    f.op = (op == "and") ? dtaFilter::AND : dtaFilter::OR;
+    List args = node["args"];
+    for (R_xlen_t i=0; i<args.size(); ++i)
+      f.args.push_back(dtaCompileFilter(args[i], varnames, vartype, coloff,
+                                        release));
+    return f;
+  }
 
-  /*
-  * version is a 4 byte character e.g. "117"
-  */
+  if (op == "==") f.op = dtaFilter::EQ;
+  else if (op == "!=") f.op = dtaFilter::NE;
+  else if (op == "<") f.op = dtaFilter::LT;
+  else if (op == "<=") f.op = dtaFilter::LE;
+  else if (op == ">") f.op = dtaFilter::GT;
+  else if (op == ">=") f.op = dtaFilter::GE;
+  else if (op == "%in%") f.op = dtaFilter::IN;
+  else
+    throw std::range_error("Unknown filter operator " + op + ".");
+
+  // variable
+  const string var = as<string>(node["var"]);
+  int v = -1;
+  for (R_xlen_t i=0; i<varnames.size(); ++i)
+    if (as<string>(varnames[i]) == var)
+      v = i;
+  if (v < 0)
+    throw std::range_error("Unknown variable " + var + " in filter.");
+
+  f.type = vartype[v];
+  f.coloff = coloff[v];
+  if (f.type == 32768)
+    throw std::range_error("strL variable " + var + " can not be filtered.");
+
+  // value
+  SEXP value = node["value"];
+  if ((f.type <= 2045) != (TYPEOF(value) == STRSXP))
+    throw std::range_error("Type of value does not match variable " + var +
+                           " in filter.");
+
+  if (f.type <= 2045)
+  {
+    // values are compared with the bytes in the encoding of the file
+    CharacterVector vals(value);
+    std::string val;
+    for (R_xlen_t i=0; i<vals.size(); ++i)
+    {
+      encodeString(STRING_ELT(vals, i), release, val);
+      f.strs.insert(val);
+      if (i == 0)
+        f.str = val;
+    }
+  } else {
+    NumericVector vals(value);
+    for (R_xlen_t i=0; i<vals.size(); ++i)
+      if (!ISNAN((double)vals[i]))
+        f.nums.insert(vals[i]);
+    f.num = vals.size() > 0 ? (double)vals[0] : NA_REAL;
+  }
+  if (f.op != dtaFilter::IN && (f.type <= 2045 ? f.strs.size() : Rf_xlength(value)) != 1)
+    throw std::range_error("Comparisons in filter need a single value.");
 
-  int8_t fversion = 117L; //f = first
-  int8_t lversion = 118L; //l = last
+  return f;
+}
 
-  std::string version(3, '\0');
-  readstring(version, file, version.size());
+// evaluates filter f for the observation starting at row
+static bool dtaEvalFilter(const dtaFilter &f, const char * row, bool swapit)
+{
+  switch(f.op)
+  {
+  case dtaFilter::AND:
+    for (size_t i=0; i<f.args.size(); ++i)
+      if (!dtaEvalFilter(f.args[i], row, swapit))
+        return false;
+    return true;
+  case dtaFilter::OR:
+    for (size_t i=0; i<f.args.size(); ++i)
+      if (dtaEvalFilter(f.args[i], row, swapit))
+        return true;
+    return false;
+  }
 
-  int8_t const release = atoi(version.c_str());
+  const char * p = row + f.coloff;
+  int cmp = 0;
 
-  IntegerVector versionIV(1);
-  versionIV(0) = release;
+  if (f.type <= 2045)
+  {
+    int32_t nchar = 0;
+    while (nchar < f.type && p[nchar] != '\0')
+      ++nchar;
+    std::string val(p, nchar);
+
+    if (f.op == dtaFilter::IN)
+      return f.strs.count(val) > 0;
+    cmp = val.compare(f.str);
+  } else {
+    double val = NA_REAL;
+    switch(f.type)
+    {
+    case 65526: val = dtaDouble(p, swapit, 0); break;
+    case 65527: val = dtaFloat(p, swapit, 0); break;
+    case 65528: val = dtaLong(p, swapit, 0); break;
+    case 65529: val = dtaInt(p, swapit, 0); break;
+    case 65530: val = dtaByte(p, swapit, 0); break;
+    }
+    if (f.type >= 65528 && val == NA_INTEGER)
+      return false;
+    if (ISNAN(val))
+      return false;
+
+    if (f.op == dtaFilter::IN)
+      return f.nums.count(val) > 0;
+    if (ISNAN(f.num))
+      return false;
+    cmp = (val < f.num) ? -1 : (val > f.num);
+  }
 
-  // check the release version.
-  if (release<fversion || release>lversion)
+  switch(f.op)
   {
-    Rcpp::stop("File version is %d.\nVersion: Not a version 13/14 dta-file", release);
+  case dtaFilter::EQ: return cmp == 0;
+  case dtaFilter::NE: return cmp != 0;
+  case dtaFilter::LT: return cmp < 0;
+  case dtaFilter::LE: return cmp <= 0;
+  case dtaFilter::GT: return cmp > 0;
+  case dtaFilter::GE: return cmp >= 0;
   }
+  return false;
+}
 
-  uint8_t nvarnameslen = 0;
-  int8_t nformatslen = 0;
-  uint8_t nvalLabelslen = 0;
-  uint16_t nvarLabelslen = 0;
-  int32_t chlen = 0;
-  uint8_t lbllen = 0;
+/*
+ * Random sample of k out of n observations (Floyd's algorithm). The random
+ * numbers are drawn from R, so samples are reproducible with set.seed(). The
+ * observations are returned in file order.
+ */
+static std::vector<uint64_t> dtaSample(uint64_t n, uint64_t k)
+{
+  std::set<uint64_t> drawn;
+  if (k > n)
+    k = n;
 
-  switch(release)
+  RNGScope scope;
+  for (uint64_t j = n - k; j < n; ++j)
   {
-  case 117:
-    nvarnameslen = 33;
-    nformatslen = 49;
-    nvalLabelslen = 33;
-    nvarLabelslen = 81;
-    chlen = 33;
-    lbllen = 33;
-    break;
-  case 118:
-    nvarnameslen = 129;
-    nformatslen = 57;
-    nvalLabelslen = 129;
-    nvarLabelslen = 321;
-    chlen = 129;
-    lbllen = 129;
-    break;
+    uint64_t t = (uint64_t)(unif_rand() * (j + 1));
+    if (t > j)
+      t = j;
+    if (!drawn.insert(t).second)
+      drawn.insert(j);
   }
 
-  fseek(file, 10, SEEK_CUR); // </release>
-  test("<byteorder>", file);
+  return std::vector<uint64_t>(drawn.begin(), drawn.end());
+}
 
-  /*
-  * byteorder is a 4 byte character e.g. "LSF". MSF referes to big-memory data.
-  */
+/*
+ * Reading of selected observations. Observations close to the requested one
+ * are read in the same range instead of seeking to each of them. The ranges
+ * are known in advance and read ahead by a dtaPrefetch (dtacore.h).
+ */
+struct dtaRows
+{
+  uint64_t rowlen;
+  std::vector<uint64_t> firsts;   // first observation of each range
+  dtaPrefetch * pf;
+  uint64_t first, last;           // observations [first, last) are in buf
+  const char * buf;
+};
+
+static const uint64_t dtaRowsGap = 1 << 16;     // bytes read instead of seeking
+static const uint64_t dtaRowsBlock = 1 << 20;   // bytes read at once
+
+// ranges of the observations select in the order dtaReadRow() needs them
+static std::vector<dtaRange> dtaRowRanges(dtaRows &dr,
+                                          const std::vector<uint64_t> &select,
+                                          uint64_t data)
+{
+  std::vector<dtaRange> ranges;
+  uint64_t first = 0, last = 0;
 
-  std::string byteorder(3, '\0');
-  readstring(byteorder,file, byteorder.size());
+  for (uint64_t j = 0; j < select.size(); ++j)
+  {
+    uint64_t const r = select[j];
+    if (r >= first && r < last)
+      continue;
 
-  fseek(file, 12, SEEK_CUR); // </byteorder>
-  test("<K>", file);
+    // extend the range by following observations in file order
+    uint64_t end = r;
+    for (uint64_t jj = j + 1; jj < select.size(); ++jj)
+    {
+      uint64_t const next = select[jj];
+      if (next <= end || (next - end - 1) * dr.rowlen > dtaRowsGap ||
+          (next - r + 1) * dr.rowlen > dtaRowsBlock)
+        break;
+      end = next;
+    }
 
-  bool swapit = 0;
-  swapit = strcmp(byteorder.c_str(), lsf);
+    dtaRange range;
+    range.pos = data + r * dr.rowlen;
+    range.len = (end - r + 1) * dr.rowlen;
+    ranges.push_back(range);
+    dr.firsts.push_back(r);
+    first = r;
+    last = end + 1;
+  }
 
-  /*
-  * Number of Variables
-  */
+  dr.first = dr.last = 0;
+  return ranges;
+}
 
-  uint16_t k = 0;
-  k = readbin(k, file, swapit);
+// returns observation select[j]
+static const char * dtaReadRow(dtaRows &dr, const std::vector<uint64_t> &select,
+                               uint64_t j)
+{
+  uint64_t const r = select[j];
 
-  fseek(file, 4, SEEK_CUR); //</K>
-  test("<N>", file);
+  if (r < dr.first || r >= dr.last)
+  {
+    const std::string &buf = dr.pf->next();
+    dr.first = dr.firsts[dr.pf->position() - 1];
+    dr.last = dr.first + buf.size() / dr.rowlen;
+    dr.buf = buf.data();
+  }
 
-  /*
-  * Number of Observations
-  */
+  return dr.buf + (r - dr.first) * dr.rowlen;
+}
 
-  int64_t n = 0;
+/*
+ * Sink of the decoder (dtacore.h) filling the vectors of a list. Stata
+ * missings become NA, extended missings are collected by row. Strings are
+ * copied as bytes if compact, strL references then as in a file of release
+ * in native byte order.
+ */
+class dtaListSink : public dtaSink
+{
+public:
+  dtaListSink(List df, uint8_t release, bool compact, bool missing, bool refs,
+              std::vector< std::vector<int32_t> > &narow,
+              std::vector< std::vector<int32_t> > &natype,
+              std::set<uint64_t> &strlrefs) :
+  df(df), release(release), compact(compact), missing(missing), refs(refs),
+  narow(narow), natype(natype), strlrefs(strlrefs) {}
+
+  void doubles(uint32_t i, uint64_t first, uint64_t m, const double * val,
+               const int8_t * na)
+  {
+    double * x = REAL(VECTOR_ELT(df, i)) + first;
+    for (uint64_t j=0; j<m; ++j)
+    {
+      x[j] = na[j] < 0 ? val[j] : NA_REAL;
+      if (missing && na[j] > 0)
+        extended(i, first + j, na[j]);
+    }
+  }
 
-  if(release==117) {
-    n = readbin((int32_t)n, file, swapit);
+  void ints(uint32_t i, uint64_t first, uint64_t m, const int32_t * val,
+            const int8_t * na)
+  {
+    int * x = INTEGER(VECTOR_ELT(df, i)) + first;
+    for (uint64_t j=0; j<m; ++j)
+    {
+      x[j] = na[j] < 0 ? val[j] : NA_INTEGER;
+      if (missing && na[j] > 0)
+        extended(i, first + j, na[j]);
+    }
   }
-  if (release ==118) {
-    n = readbin(n, file, swapit);
+
+  void strings(uint32_t i, uint64_t first, uint64_t m, const char * val,
+               int32_t width)
+  {
+    SEXP x = VECTOR_ELT(df, i);
+    if (compact)
+    {
+      memcpy(RAW(x) + first * width, val, m * width);
+      return;
+    }
+    for (uint64_t j=0; j<m; ++j)
+      SET_STRING_ELT(x, first + j, dtaStr(val + j * width, width));
+    dtaProf.charsxp(m);
   }
 
-  fseek(file, 4, SEEK_CUR); //</N>
-  test("<label>", file);
+  void strls(uint32_t i, uint64_t first, uint64_t m, const uint64_t * ref)
+  {
+    SEXP x = VECTOR_ELT(df, i);
+    for (uint64_t j=0; j<m; ++j)
+    {
+      if (refs)
+        strlrefs.insert(ref[j]);
 
-  /*
-  * A dataset may have a label e.g. "Written by R".
-  * First we read its length (ndlabel), later the actual label (datalabel).
-  * ndlabel:   length of datalabel (excl. binary 0)
-  * datalabel: string max length 80
-  */
+      if (compact)
+      {
+        dtaStoreStrl((char *)RAW(x) + (first + j) * 8, ref[j], release, 0);
+      } else {
+        char val_strl[42];
+        dtaStrlKey(val_strl, sizeof val_strl, ref[j], release);
+        SET_STRING_ELT(x, first + j, Rf_mkChar(val_strl));
+      }
+    }
+    if (!compact)
+      dtaProf.charsxp(m);
+  }
 
-  uint16_t ndlabel = 0;
+private:
+  void extended(uint32_t i, uint64_t row, int type)
+  {
+    narow[i].push_back(row + 1);
+    natype[i].push_back(type);
+  }
 
-  if (release==118)
-    ndlabel = readbin(ndlabel, file, swapit);
-  if (release==117)
-    ndlabel = readbin((int8_t)ndlabel, file, swapit);
+  List df;
+  uint8_t release;
+  bool compact, missing, refs;
+  std::vector< std::vector<int32_t> > &narow, &natype;
+  std::set<uint64_t> &strlrefs;
+};
 
-  std::string datalabel(ndlabel, '\0');
+/*
+ * Statistics of the variables (see dtaStats) as data.frame with a row for
+ * each variable. Strings have no min, max and sum, strLs no distinct count.
+ */
+static List dtaStatsFrame(const std::vector<dtaStats> &st,
+                          IntegerVector vartype, CharacterVector varnames)
+{
+  size_t const k = st.size();
 
-  if (ndlabel>0)
+  NumericVector count(k), na(k), extended(k), min(k), max(k), sum(k),
+    distinct(k);
+  for (size_t i=0; i<k; ++i)
   {
-    readstring(datalabel, file, datalabel.size());
-  } else {
-    datalabel = "";
+    int const type = vartype[i];
+    bool const str = type <= 2045 || type == 32768;
+    bool const none = str || st[i].count == 0;
+    count[i] = st[i].count;
+    na[i] = st[i].na;
+    extended[i] = st[i].extended;
+    min[i] = none ? NA_REAL : st[i].min;
+    max[i] = none ? NA_REAL : st[i].max;
+    sum[i] = str ? NA_REAL : st[i].sum;
+    distinct[i] = type == 32768 ? NA_REAL : st[i].distinct();
   }
 
-  CharacterVector datalabelCV(1);
-  datalabelCV(0) = datalabel;
-
-  fseek(file, 8, SEEK_CUR); //</label>
-  test("<timestamp>", file);
+  List res(8);
+  res[0] = varnames;
+  res[1] = count;
+  res[2] = na;
+  res[3] = extended;
+  res[4] = min;
+  res[5] = max;
+  res[6] = sum;
+  res[7] = distinct;
+  res.attr("names") = CharacterVector::create("variable", "count", "na",
+                                              "extended", "min", "max",
+                                              "sum", "distinct");
+  res.attr("row.names") = IntegerVector::create(NA_INTEGER, -(int)k);
+  res.attr("class") = "data.frame";
+  return res;
+}
 
+// Reads the binary Stata file
+//
+// @param filePath The full systempath to the dta file you want to import.
+// @param missing logical if the types of extended missings should be returned
+// in attribute missing.
+// @param lazy logical if the variables should be read on first access.
+// @param rows NULL or the observations to read (starting with 1).
+// @param key NULL or a list of values of the sort variables. Only the
+// observations matching the key are read.
+// @param filter NULL or a filter compiled by compile.filter(). Only the
+// observations passing the filter are read.
+// @param sample NULL or the number of observations drawn at random. Drawn
+// from the selected observations if rows or key are given.
+// @param stats logical if statistics of the variables should be returned in
+// attribute stats.
+// @import Rcpp
+// @export
+// [[Rcpp::export]]
+List stata(const char * filePath, const bool missing, const bool lazy,
+           SEXP rows, SEXP key, SEXP filter, SEXP sample, const bool stats)
+{
   /*
-  * A dataset may have a timestamp. If it has a timestamp the length of the
-  * timestamp (ntimestamp) is 17. Else it is zero.
-  * ntimestamp: 0 or 17
-  * timestamp: empty or 17 byte string
+  * Open the file in binary mode using the "rb" format string
+  * This also checks if the file exists and/or can be opened for reading correctly.
+  * It is closed on return and if reading is interrupted.
   */
 
-  uint8_t ntimestamp = 0;
-  ntimestamp = readbin(ntimestamp, file, swapit);
+  dtaFile file(filePath, "rb");
+  if (file == NULL)
+    throw std::range_error("Could not open specified file.");
 
-  std::string timestamp(17, '\0');
+  /*
+  * header, map and variable types (see dtacore.cpp)
+  */
 
-  if (ntimestamp == 17) // ntimestap is 0 or 17
-  {
-    readstring(timestamp, file, timestamp.size());
-  } else {
-    timestamp = "";
-  }
+  dtaProfileScope prof(dtaProfileOption(), "header");
 
-  CharacterVector timestampCV = timestamp;
+  dtaHeader h;
+  dtaReadHeader(file, h);
 
-  fseek(file, 21, SEEK_CUR); //</timestamp></header>
-  test("<map>", file);
+  int8_t const release = h.release;
+  std::string const &byteorder = h.byteorder;
+  bool const swapit = h.swapit;
+  uint32_t const k = h.k;
+  int64_t const n = h.n;
+  std::vector<uint64_t> const &map = h.map;
 
-  /*
-  * Stata stores the byteposition of certain areas of the file here. Currently
-  * this is of no use to us.
-  * 1.  <stata_data>
-  * 2.  <map>
-  * 3.  <variable_types>
-  * 4.  <varnames>
-  * 5.  <sortlist>
-  * 6.  <formats>
-  * 7.  <value_label_names>
-  * 8.  <variable_labels>
-  * 9.  <characteristics>
-  * 10. <data>
-  * 11. <strls>
-  * 12. <value_labels>
-  * 13. </stata_data>
-  * 14. end-of-file
-  */
+  IntegerVector versionIV(1);
+  versionIV(0) = release;
 
-  IntegerVector map(14);
-  for (int i=0; i <14; ++i)
-  {
-    uint64_t nmap = 0;
-    nmap = readbin(nmap, file, swapit);
-    map[i] = nmap;
-  }
+  uint8_t const nvarnameslen = h.nvarnameslen;
+  int8_t const nformatslen = h.nformatslen;
+  uint8_t const nvalLabelslen = h.nvalLabelslen;
+  uint16_t const nvarLabelslen = h.nvarLabelslen;
+  int32_t const chlen = h.chlen;
+  uint8_t const lbllen = h.lbllen;
 
-  fseek(file, 6, SEEK_CUR); //</map>
-  test("<variable_types>", file);
+  CharacterVector datalabelCV(1);
+  datalabelCV(0) = h.datalabel;
 
-  /*
-  * vartypes.
-  * 0-2045: strf (String: Max length 2045)
-  * 32768:  strL (long String: Max length 2 billion)
-  * 65526:  double
-  * 65527:  float
-  * 65528:  long
-  * 65529:  int
-  * 65530:  byte
-  */
+  CharacterVector timestampCV = h.timestamp;
 
-  IntegerVector vartype(k);
-  for (uint16_t i=0; i<k; ++i)
-  {
-    uint16_t nvartype = 0;
-    nvartype = readbin(nvartype, file, swapit);
-    vartype[i] = nvartype;
-  }
+  IntegerVector vartype(h.vartype.begin(), h.vartype.end());
 
-  fseek(file, 17, SEEK_CUR); //</variable_types>
   test("<varnames>", file);
 
   /*
@@ -295,7 +560,7 @@ List stata(const char * filePath, const bool missing)
   std::string nvarnames(nvarnameslen, '\0');
 
   CharacterVector varnames(k);
-  for (uint16_t i=0; i<k; ++i)
+  for (uint32_t i=0; i<k; ++i)
   {
     readstring(nvarnames, file, nvarnames.size());
     varnames[i] = nvarnames;
@@ -306,20 +571,29 @@ List stata(const char * filePath, const bool missing)
 
   /*
   * sortlist. Stata stores the information which variable of a dataset was
-  * sorted. Depending on byteorder sortlist is written different. Currently we
-  * do not use this information.
-  * Vector size is k+1.
+  * sorted. Depending on byteorder sortlist is written different. The list
+  * holds the variable numbers (starting with 1) of the sort variables and
+  * ends with 0. It is used for keyed lookups.
+  * Vector size is k+1. Variable numbers take 4 bytes in 119, 2 bytes before.
   */
 
   uint32_t big_k = k+1;
 
-  IntegerVector sortlist(big_k);
+  std::vector<int32_t> sortvars;
+  bool sorted = true;
   for (uint32_t i=0; i<big_k; ++i)
   {
-    uint16_t nsortlist = 0;
-    nsortlist = readbin(nsortlist, file, swapit);
-    sortlist[i] = nsortlist;
+    uint32_t nsortlist = 0;
+    if (release==119)
+      nsortlist = readbin(nsortlist, file, swapit);
+    else
+      nsortlist = readbin((uint16_t)0, file, swapit);
+    if (nsortlist == 0)
+      sorted = false;
+    if (sorted && nsortlist <= k)
+      sortvars.push_back(nsortlist);
   }
+  IntegerVector sortlist(sortvars.begin(), sortvars.end());
 
   fseek(file, 11, SEEK_CUR); //</sortlist>
   test("<formats>", file);
@@ -332,7 +606,7 @@ List stata(const char * filePath, const bool missing)
   std::string nformats(nformatslen, '\0');
 
   CharacterVector formats(k);
-  for (uint16_t i=0; i<k; ++i)
+  for (uint32_t i=0; i<k; ++i)
   {
     readstring(nformats, file, nformats.size());
     formats[i] = nformats;
@@ -350,7 +624,7 @@ List stata(const char * filePath, const bool missing)
   std::string nvalLabels(nvalLabelslen, '\0');
 
   CharacterVector valLabels(k);
-  for (uint16_t i=0; i<k; ++i)
+  for (uint32_t i=0; i<k; ++i)
   {
     readstring(nvalLabels, file, nvalLabels.size());
     valLabels[i] = nvalLabels;
@@ -366,7 +640,7 @@ List stata(const char * filePath, const bool missing)
   std::string nvarLabels (nvarLabelslen, '\0');
 
   CharacterVector varLabels(k);
-  for (uint16_t i=0; i<k; ++i)
+  for (uint32_t i=0; i<k; ++i)
   {
     readstring(nvarLabels, file, nvarLabels.size());
     varLabels[i] = nvarLabels;
@@ -391,8 +665,8 @@ List stata(const char * filePath, const bool missing)
   std::string tago(4, '\0');
   readstring(tago, file, tago.size());
 
-  List ch = List();
-  CharacterVector chs(3);
+  // each <ch> takes at least 13 + 2*chlen bytes
+  dtaList ch((map[9] - map[8]) / (13 + 2 * chlen));
 
   while (chtag.compare(tago)==0)
   {
@@ -414,7 +688,7 @@ List stata(const char * filePath, const bool missing)
     chs[2] = nnocharacter;
 
     // add characteristics to the list
-    ch.push_front( chs );
+    ch.add(chs);
 
     //fseek(file, 5, SEEK_CUR); // </ch>
     test("</ch>", file);
@@ -426,6 +700,8 @@ List stata(const char * filePath, const bool missing)
   fseek(file, 14, SEEK_CUR); //[</ch]aracteristics>
   test("<data>", file);
 
+  dtaProf.phase("data");
+
   /*
   * data. First a list is created with vectors. The vector type is defined by
   * vartype. Stata stores data columnwise so we loop over it and store the
@@ -433,147 +709,315 @@ List stata(const char * filePath, const bool missing)
   * attatched and the list type is changed to data.frame.
   */
 
-  // 1. create the list
-  List df(k);
-  for (uint16_t i=0; i<k; ++i)
+  // each variable starts at coloff within an observation of rowlen bytes
+  std::vector<uint64_t> const &coloff = h.coloff;
+  uint64_t const rowlen = h.rowlen;
+  uint64_t const data = h.data;
+
+  /*
+  * Selection of observations by row number, by key or at random. Selected
+  * observations are read by seeking to them.
+  */
+  bool const selected = !Rf_isNull(rows) || !Rf_isNull(key) ||
+    !Rf_isNull(sample);
+  std::vector<uint64_t> select;
+
+  if (!Rf_isNull(key))
   {
-    int const type = vartype[i];
-    switch(type)
+    List keys(key);
+    if (keys.size() > (R_xlen_t)sortvars.size())
+      throw std::range_error("The key has more values than the file has sort variables.");
+
+    dtaKey dk;
+    dk.file = file;
+    dk.data = data;
+    dk.rowlen = rowlen;
+    dk.swapit = swapit;
+    for (R_xlen_t i=0; i<keys.size(); ++i)
     {
-    case 65526:
-    case 65527:
-      SET_VECTOR_ELT(df, i, NumericVector(no_init(n)));
-      break;
+      int32_t const v = sortvars[i] - 1;
+      int32_t const type = vartype[v];
+      if (type == 32768)
+        throw std::range_error("strL variables can not be used as key.");
+
+      dk.types.push_back(type);
+      dk.coloff.push_back(coloff[v]);
+      if (type <= 2045)
+      {
+        // the key in the encoding of the file
+        std::string val;
+        CharacterVector kv = as<CharacterVector>(keys[i]);
+        encodeString(STRING_ELT(kv, 0), release, val);
+        dk.str.push_back(val);
+        dk.num.push_back(NA_REAL);
+      } else {
+        dk.str.push_back("");
+        dk.num.push_back(as<double>(keys[i]));
+      }
+    }
 
-    case 65528:
-    case 65529:
-    case 65530:
-      SET_VECTOR_ELT(df, i, IntegerVector(no_init(n)));
-      break;
+    // binary search for the first and the last matching observation
+    uint64_t lo = 0, hi = n;
+    while (lo < hi)
+    {
+      uint64_t const mid = lo + (hi - lo) / 2;
+      if (dtaKeyCompare(dk, mid) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    uint64_t const first = lo;
 
-    default:
-      SET_VECTOR_ELT(df, i, CharacterVector(no_init(n)));
-    break;
+    hi = n;
+    while (lo < hi)
+    {
+      uint64_t const mid = lo + (hi - lo) / 2;
+      if (dtaKeyCompare(dk, mid) <= 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+    for (uint64_t r=first; r<lo; ++r)
+      select.push_back(r);
+  }
+  else if (!Rf_isNull(rows))
+  {
+    NumericVector r(rows);
+    for (R_xlen_t i=0; i<r.size(); ++i)
+    {
+      double const ri = r[i];
+      if (!(ri >= 1 && ri <= n))
+        throw std::range_error("Selected rows are out of range.");
+      select.push_back((uint64_t)ri - 1);
     }
   }
 
-  // 2. fill it with data
-  for(uint32_t j=0; j<n; ++j)
+  if (!Rf_isNull(sample))
   {
-    for (uint16_t i=0; i<k; ++i)
+    double const ns = as<double>(sample);
+    if (!(ns >= 0))
+      throw std::range_error("The sample size must not be negative.");
+
+    bool const all = Rf_isNull(rows) && Rf_isNull(key);
+    uint64_t const ncand = all ? n : select.size();
+    std::vector<uint64_t> drawn = dtaSample(ncand, ns < ncand ? (uint64_t)ns : ncand);
+
+    if (!all)
+      for (size_t j=0; j<drawn.size(); ++j)
+        drawn[j] = select[drawn[j]];
+    select.swap(drawn);
+  }
+
+  uint64_t nout = selected ? select.size() : n;
+
+  dtaRows dr;
+  dr.rowlen = rowlen;
+  std::vector<dtaRange> rowranges;
+  if (selected)
+    rowranges = dtaRowRanges(dr, select, data);
+
+  /*
+  * Filter. Observations are read in blocks, only the variables used by the
+  * filter are decoded. Observations passing it are kept as bytes and decoded
+  * completely afterwards.
+  */
+  bool const filtered = !Rf_isNull(filter);
+  std::vector<char> kept;
+
+  if (filtered)
+  {
+    dtaFilter f = dtaCompileFilter(filter, varnames, vartype, coloff,
+                                   release);
+
+    uint64_t const ncand = nout;
+    uint64_t const block = dtaBlockRows(h);
+    dtaProgress progress("filtering data", ncand * rowlen);
+
+    dtaPrefetch pf(file, selected ? rowranges :
+                   dtaBlockRanges(h, ncand, block), !selected);
+    dr.pf = &pf;
+
+    for (uint64_t j=0; j<ncand; )
     {
-      int const type = vartype[i];
-      switch(type < 2046 ? 2045 : type)
+      uint64_t m = (ncand - j < block) ? ncand - j : block;
+      const char * obs;
+      if (selected)
       {
-        // double
-      case 65526:
-      {
-        double val_d = 0;
-        val_d = readbin(val_d, file, swapit);
-
-        if ((missing == FALSE) & !(val_d == R_NegInf) & ((val_d<STATA_DOUBLE_NA_MIN) | (val_d>STATA_DOUBLE_NA_MAX)) )
-          REAL(VECTOR_ELT(df,i))[j] = NA_REAL;
-        else
-          REAL(VECTOR_ELT(df,i))[j] = val_d;
-        break;
+        m = 1;
+        obs = dtaReadRow(dr, select, j);
+      } else {
+        obs = pf.next().data();
       }
-        // float
-      case 65527:
-      {
-        float val_f = 0;
-        val_f = readbin(val_f, file, swapit);
 
-        if ((missing == FALSE) & ((val_f<STATA_FLOAT_NA_MIN) | (val_f>STATA_FLOAT_NA_MAX)) )
-          REAL(VECTOR_ELT(df,i))[j] = NA_REAL;
-        else
-          REAL(VECTOR_ELT(df,i))[j] = val_f;
-        break;
-      }
-        //long
-      case 65528:
+      for (uint64_t r=0; r<m; ++r)
       {
-        int32_t val_l = 0;
-        val_l = readbin(val_l, file, swapit);
-
-        if ((missing == FALSE) & ((val_l<STATA_INT_NA_MIN) | (val_l>STATA_INT_NA_MAX)) )
-          INTEGER(VECTOR_ELT(df,i))[j]  = NA_INTEGER;
-        else
-          INTEGER(VECTOR_ELT(df,i))[j] = val_l;
-        break;
+        const char * p = obs + r * rowlen;
+        if (dtaEvalFilter(f, p, swapit))
+          kept.insert(kept.end(), p, p + rowlen);
       }
-        // int
-      case 65529:
-      {
-        int16_t val_i = 0;
-        val_i = readbin(val_i, file, swapit);
+      j += m;
+      progress.add(m * rowlen);
+    }
+    progress.finish();
+    dtaProf.buffer(kept.size());
 
-        if ((missing == FALSE) & ((val_i<STATA_SHORTINT_NA_MIN) | (val_i>STATA_SHORTINT_NA_MAX)) )
-          INTEGER(VECTOR_ELT(df,i))[j] = NA_INTEGER;
-        else
-          INTEGER(VECTOR_ELT(df,i))[j] = val_i;
+    nout = rowlen > 0 ? kept.size() / rowlen : 0;
+  }
+
+  List df(k);
+
+  // strLs referenced by selected observations. Only these are read.
+  std::set<uint64_t> strlrefs;
+
+  // rows and types of extended missings (.a to .z) of each variable
+  std::vector< std::vector<int32_t> > narow(k), natype(k);
+
+  // statistics of the variables, collected while decoding
+  std::vector<dtaStats> colstats;
+
+  if (lazy && !missing && !stats && !selected && !filtered &&
+      dtaLazyAvailable())
+  {
+    /*
+    * Lazy variables only know where to find their values in the file. The
+    * data is skipped and read on first access.
+    */
+    SEXP lazyfile = PROTECT(dtaLazyFile(filePath, data, rowlen, n, release,
+                                        swapit, missing));
+    for (uint32_t i=0; i<k; ++i)
+      SET_VECTOR_ELT(df, i, dtaLazyColumn(lazyfile, vartype[i], coloff[i]));
+    UNPROTECT(1);
+
+    fseek(file, map[10], SEEK_SET);
+  } else {
+
+    /*
+    * Strings are kept as a block of fixed width bytes per variable if ALTREP
+    * is available. They become CHARSXPs on access.
+    */
+    bool const compact = dtaLazyAvailable();
+
+    // 1. create the list
+    for (uint32_t i=0; i<k; ++i)
+    {
+      int const type = vartype[i];
+      switch(type)
+      {
+      case 65526:
+      case 65527:
+        SET_VECTOR_ELT(df, i, NumericVector(no_init(nout)));
         break;
-      }
-        // byte
+
+      case 65528:
+      case 65529:
       case 65530:
-      {
-        int8_t val_b = 0;
-        val_b = readbin(val_b, file, swapit);
+        SET_VECTOR_ELT(df, i, IntegerVector(no_init(nout)));
+        break;
 
-        if ((missing == FALSE) & ( (val_b<STATA_BYTE_NA_MIN) | (val_b>STATA_BYTE_NA_MAX)) )
-          INTEGER(VECTOR_ELT(df,i))[j] = NA_INTEGER;
+      default:
+        if (compact)
+          SET_VECTOR_ELT(df, i, RawVector(no_init(nout * dtaWidth(type))));
         else
-          INTEGER(VECTOR_ELT(df,i))[j] = val_b;
-        break;
+          SET_VECTOR_ELT(df, i, CharacterVector(no_init(nout)));
+      break;
       }
-        // strings with 2045 or fewer characters
-      case 2045:
-      {
-        int32_t len = 0;
-        len = vartype[i];
-        std::string val_s (len, '\0');
+    }
 
-        readstring(val_s, file, val_s.size());
-        as<CharacterVector>(df[i])[j] = val_s;
-        break;
-      }
-        // string of any length
-      case 32768:
-      {// strL 2 4bit
-
-        // FixMe: Strl in 118
-        // if (release==117)
-        int32_t v = 0, o = 0;
-        //         if (release==118) {
-        //           int32_t v=0;
-        //           int64_t o=0;
-        //         }
-        v = readbin(v, file, swapit);
-        o = readbin(o, file, swapit);
-
-        // if(release==117)
-        char val_strl[22];
-        //         if(release==118)
-        //           char val_strl[22];
-        sprintf(val_strl, "%010d%010d", v, o);
-        as<CharacterVector>(df[i])[j] = val_strl;
-        break;
+    // 2. fill it with data. Blocks of observations are decoded at once.
+    dtaListSink sink(df, release, compact, missing, selected || filtered,
+                     narow, natype, strlrefs);
+    dtaStatsSink statssink(h, sink);
+    dtaSink &out = stats ? (dtaSink &)statssink : (dtaSink &)sink;
+    dtaDecoder dec(h);
+
+    uint64_t const block = dtaBlockRows(h);
+    std::string buf;
+    dtaProgress progress("reading data", nout * rowlen);
+
+    // kept observations are in memory already
+    std::vector<dtaRange> ranges;
+    if (!filtered)
+      ranges = selected ? rowranges : dtaBlockRanges(h, nout, block);
+    dtaPrefetch pf(file, ranges, !selected);
+    dr.pf = &pf;
+
+    for (uint64_t j=0; j<nout; )
+    {
+      uint64_t const m = (nout - j < block) ? nout - j : block;
+      const char * obs;
+
+      if (filtered)
+      {
+        obs = &kept[j * rowlen];
+      } else if (selected) {
+        buf.resize(m * rowlen);
+        for (uint64_t r=0; r<m; ++r)
+          memcpy(&buf[r * rowlen], dtaReadRow(dr, select, j + r), rowlen);
+        obs = buf.data();
+      } else {
+        obs = pf.next().data();
       }
+
+      dtaProf.buffer(m * rowlen);
+      dec.decode(obs, j, m, out);
+      j += m;
+      progress.add(m * rowlen);
+    }
+    progress.finish();
+
+    if (compact)
+    {
+      for (uint32_t i=0; i<k; ++i)
+      {
+        int const type = vartype[i];
+        if (type <= 2045 || type == 32768)
+          SET_VECTOR_ELT(df, i, dtaCompactString(VECTOR_ELT(df, i), type,
+                                                 release, false));
       }
     }
+
+    colstats.swap(statssink.stats);
+
+    // the prefetcher does not move the position of the file
+    dtaSeek(file, map[10]);
   }
 
   // 3. Create a data.frame
-  R_xlen_t nrows = Rf_length(df[0]);
-  df.attr("row.names") = IntegerVector::create(NA_INTEGER, nrows);
+  df.attr("row.names") = IntegerVector::create(NA_INTEGER, (int32_t)nout);
   df.attr("names") = varnames;
   df.attr("class") = "data.frame";
 
-  fseek(file, 7, SEEK_CUR); //</data>
+  /*
+  * Stata missings are NA. Extended missings are listed by variable as rows
+  * and types (1 to 26 for .a to .z). Variables without are NULL.
+  */
+  if (missing)
+  {
+    List missings(k);
+    for (uint32_t i=0; i<k; ++i)
+    {
+      if (narow[i].empty())
+        continue;
+      List na(2);
+      na[0] = IntegerVector(narow[i].begin(), narow[i].end());
+      na[1] = IntegerVector(natype[i].begin(), natype[i].end());
+      na.attr("names") = CharacterVector::create("row", "type");
+      missings[i] = na;
+    }
+    missings.attr("names") = varnames;
+    df.attr("missing") = missings;
+  }
+
+  if (stats)
+    df.attr("stats") = dtaStatsFrame(colstats, vartype, varnames);
+
+  dtaProf.phase("strls");
   test("<strls>", file);
 
   /*
   * strL. Stata 13 introduced long strings up to 2 billon characters. strLs are
-  * sperated by "GSO".
+  * sperated by "GSO" (see dtaGso).
   * (v,o): Position in the data.frame.
   * t:     129/130 defines whether or not the strL is stored with a binary 0.
   * len:   length of the strL.
@@ -582,30 +1026,36 @@ List stata(const char * filePath, const bool missing)
 
   std::string gso = "GSO";
 
-  std::string tags(3, '\0');
+  std::string tags(3, '\0'), gsohead(dtaGsoSize(release), '\0');
   readstring(tags, file, tags.size());
 
-  List strlstable = List(); //put strLs into this list
+  // put strLs into this list. A GSO takes at least 16 bytes
+  dtaList strlstable((map[11] - map[10]) / 16);
+  dtaProgress strlprogress("reading strls", map[11] - map[10]);
 
   while(gso.compare(tags)==0)
   {
     CharacterVector strls(2);
 
-    // 2x4 bit (strl[vo1,vo2])
-    int32_t v = 0, o = 0;
-    v = readbin(v, file, swapit);
-    o = readbin(o, file, swapit);
-    char erg[22];
-    sprintf(erg, "%010d%010d", v, o);
+    // (v,o), t (129 = binary | 130 = ascii) and len
+    readstring(gsohead, file, gsohead.size());
+    dtaGso g;
+    dtaDecodeGso(gsohead.data(), release, swapit, g);
+    uint32_t const len = g.len;
+
+    char erg[42];
+    dtaStrlKey(erg, sizeof erg, g.ref, release);
 
     strls(0) = erg;
 
-    // (129 = binary) | (130 = ascii)
-    uint8_t t = 0;
-    t = readbin(t, file, swapit);
+    strlprogress.add(len + 16);
 
-    uint32_t len = 0;
-    len = readbin(len, file, swapit);
+    if ((selected || filtered) && strlrefs.count(g.ref) == 0)
+    {
+      dtaSkip(file, len);
+      readstring(tags, file, tags.size());
+      continue;
+    }
 
     // 129 len = len; 130 len = len +'\0';
 
@@ -613,14 +1063,18 @@ List stata(const char * filePath, const bool missing)
     readstring(strl, file, strl.size());
 
     strls(1) = strl;
+    dtaProf.charsxp(2);
 
-    strlstable.push_back( strls );
+    strlstable.add(strls);
 
     readstring(tags, file, tags.size());
   }
 
+  strlprogress.finish();
+
   // after strls
   fseek(file, 5, SEEK_CUR); //[</s]trls>
+  dtaProf.phase("labels");
   test("<value_labels>", file);
 
   /*
@@ -638,14 +1092,17 @@ List stata(const char * filePath, const bool missing)
   std::string tag(5, '\0');
   readstring(tag, file, tag.size());
 
-  List labelList = List(); //put labels into this list
+  // put labels into this list. A <lbl> takes at least lbllen + 26 bytes
+  dtaList labelList((map[12] - map[11]) / (lbllen + 26));
+  dtaProgress lblprogress("reading labels", map[12] - map[11]);
 
   while(lbltag.compare(tag)==0)
   {
-    int32_t nlen = 0, labn = 0, txtlen = 0, noff = 0, val = 0;
+    int32_t nlen = 0, labn = 0, txtlen = 0;
 
     // length of value_label_table
     nlen = readbin(nlen, file, swapit);
+    lblprogress.add(nlen + lbllen + 18);
 
     // name of this label set
 
@@ -660,62 +1117,50 @@ List stata(const char * filePath, const bool missing)
     labn = readbin(labn, file, swapit);
     txtlen = readbin(txtlen, file, swapit);
 
-    // offset for each label
+    // offset for each label followed by the code for each label
     // off0 : label 0 starts at off0
     // off1 : label 1 starts at off1 ...
-    IntegerVector off(labn);
-    for (int i=0; i < labn; ++i) {
-      noff = readbin(noff, file, swapit);
-      off[i] = noff;
-    }
-
-    // needed for match
-    IntegerVector laborder = clone(off);
-    //laborder.erase(labn+1);
-    IntegerVector labordersort = clone(off);
-    //labordersort.erase(labn+1);
-    std::sort(labordersort.begin(), labordersort.end());
-
-    // needs txtlen for loop
-    off.push_back(txtlen);
+    std::string tab(8 * (uint64_t)std::max(labn, 0), '\0');
+    if (labn > 0)
+      readstring(tab, file, tab.size());
 
-    // sort offsets so we can read labels sequentially
-    std::sort(off.begin(), off.end());
-
-    // create an index to sort lables along the code values
-    // this is done while factor creation
-    IntegerVector indx(labn);
-    indx = match(laborder,labordersort);
-
-    // code for each label
+    std::vector<int32_t> off(labn);
     IntegerVector code(labn);
     for (int i=0; i < labn; ++i) {
-      val = readbin(val, file, swapit);
-      code[i] = val;
+      off[i] = loadbin<int32_t>(&tab[4 * i], swapit);
+      code[i] = loadbin<int32_t>(&tab[4 * (labn + i)], swapit);
     }
 
-    // label text
-    CharacterVector label(labn);
-    for (int i=0; i < labn; ++i) {
-      int lablen = off[i+1]-off[i];
+    // label text. All texts are read at once. A label ends at its binary 0
+    // or at the next offset, so the labels are ordered by their offsets.
+    std::string txt(txtlen, '\0');
+    if (txtlen > 0)
+      readstring(txt, file, txtlen);
 
-      std::string lab (lablen, '\0');
+    std::vector<std::pair<int32_t, int32_t> > order(labn);
+    for (int i=0; i < labn; ++i)
+      order[i] = std::make_pair(off[i], i);
+    std::sort(order.begin(), order.end());
 
-      readstring(lab, file, lablen);
-      label[i] = lab;
-    }
-
-    // sort labels according to indx
     CharacterVector labelo(labn);
-    for (int i=0; i < labn; ++i) {
-      labelo[i] = label[indx[i]-1];
+    int32_t end = txtlen;
+    for (int j=labn-1; j >= 0; --j) {
+      int32_t start = order[j].first;
+      if (j+1 < labn && order[j+1].first > start)
+        end = order[j+1].first;
+      if (start < 0 || start >= txtlen)
+        labelo[order[j].second] = "";
+      else
+        labelo[order[j].second] = dtaStr(txt.data() + start,
+                                         std::min(end, txtlen) - start);
     }
+
     // create table for actual label set
-    string const labset = nlabname;
     code.attr("names") = labelo;
+    dtaProf.charsxp(labn);
 
     // add this set to output list
-    labelList.push_front( code, labset);
+    labelList.add(code, nlabname);
 
     fseek(file, 6, SEEK_CUR); //</lbl>
 
@@ -727,10 +1172,12 @@ List stata(const char * filePath, const bool missing)
    * close the file
    */
 
+  lblprogress.finish();
+
   fseek(file, 10, SEEK_CUR); // [</val]ue_labels>
   test("</stata_dta>", file);
 
-  fclose(file);
+  file.close();
 
   /*
    * assign attributes to the resulting data.frame
@@ -743,10 +1190,80 @@ List stata(const char * filePath, const bool missing)
   df.attr("val.labels") = valLabels;
   df.attr("var.labels") = varLabels;
   df.attr("version") = versionIV;
-  df.attr("label.table") = labelList;
-  df.attr("expansion.fields") = ch;
-  df.attr("strl") = strlstable;
+  df.attr("label.table") = labelList.get(true);
+  df.attr("expansion.fields") = ch.get(true);
+  df.attr("strl") = strlstable.get(false);
   df.attr("byteorder") = wrap(byteorder);
+  df.attr("sortlist") = sortlist;
 
   return df;
 }
+
+// Profile of the last read or write
+//
+// Filled by stata() and stataWrite() if options(readstata13.profile = TRUE).
+//
+// @return data.frame with a row for each phase or NULL
+// [[Rcpp::export]]
+SEXP stataProfile()
+{
+  const std::vector<dtaPhase> &ph = dtaProf.phases();
+  size_t const np = ph.size();
+  if (np == 0)
+    return R_NilValue;
+
+  CharacterVector phase(np);
+  NumericVector seconds(np), bytes(np), calls(np), charsxp(np), buffer(np);
+  for (size_t i=0; i<np; ++i)
+  {
+    phase[i] = ph[i].name;
+    seconds[i] = ph[i].seconds;
+    bytes[i] = ph[i].bytes;
+    calls[i] = ph[i].calls;
+    charsxp[i] = ph[i].charsxp;
+    buffer[i] = ph[i].buffer;
+  }
+
+  List prof(6);
+  prof[0] = phase;
+  prof[1] = seconds;
+  prof[2] = bytes;
+  prof[3] = calls;
+  prof[4] = charsxp;
+  prof[5] = buffer;
+  prof.attr("names") = CharacterVector::create("phase", "seconds", "bytes",
+                                               "calls", "charsxp", "buffer");
+  prof.attr("row.names") = IntegerVector::create(NA_INTEGER, -(int)np);
+  prof.attr("class") = "data.frame";
+  return prof;
+}
+
+// nanoseconds of the modification time, 0 where stat() has whole seconds
+static double dtaMtimeNsec(const struct stat &st)
+{
+#if defined(__APPLE__)
+  return st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+  return 0;
+#else
+  return st.st_mtim.tv_nsec;
+#endif
+}
+
+// Identity of a file for the cache of read.dta13
+//
+// @param filePath The full systempath to the dta file.
+// @return numeric vector with size, modification time (seconds), inode,
+// device and the nanoseconds of the modification time. Files rewritten in
+// place within the same second differ in the nanoseconds.
+// [[Rcpp::export]]
+NumericVector stataFileId(const char * filePath)
+{
+  struct stat st;
+  if (stat(filePath, &st) != 0)
+    throw std::range_error("Could not open specified file.");
+
+  return NumericVector::create((double)st.st_size, (double)st.st_mtime,
+                               (double)st.st_ino, (double)st.st_dev,
+                               dtaMtimeNsec(st));
+}
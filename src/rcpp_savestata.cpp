@@ -18,9 +18,12 @@
 #include <Rcpp.h>
 #include <string>
 #include <fstream>
+#include <map>
+#include <vector>
+#include <algorithm>
 #include <stdint.h>
-#include "statadefines.h"
-#include "swap_endian.h"
+#include "readstata.h"
+#include "statasinks.h"
 // #include <cstdint> //C++11
 
 using namespace Rcpp;
@@ -36,8 +39,8 @@ using namespace std;
 
 bool swapit = strcmp(byteorder, lsf);
 
-template <typename T>
-static void writebin(T t, fstream& dta, bool swapit)
+template <typename T, typename Sink>
+static void writebin(T t, Sink& dta, bool swapit)
 {
   if (swapit==1){
     T t_s = swap_endian(t);
@@ -47,29 +50,422 @@ static void writebin(T t, fstream& dta, bool swapit)
   }
 }
 
-// Writes the binary Stata file
-//
-// @param filePath The full systempath to the dta file you want to export.
-// @param dat an R-Object of class data.frame.
-// @export
-// [[Rcpp::export]]
-int stataWrite(const char * filePath, Rcpp::DataFrame dat)
+// 64 bit FNV-1a hash. Used to find duplicated strLs.
+static uint64_t strlfnv(const string &s)
 {
-  uint16_t k = dat.size();
-  uint64_t n = dat.nrows();
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < s.size(); ++i)
+  {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/*
+ * Strings are written in the encoding of the release: CP1252 for 117 and
+ * UTF-8 for 118 and 119. ASCII strings are copied. Others are translated to
+ * UTF-8 by R and for 117 mapped to CP1252. Bytes of characters CP1252 does not
+ * know are written as <xx> like iconv(sub = "byte") does.
+ */
+
+// characters of CP1252 0x80 to 0x9F. 0 is undefined.
+static const uint16_t cp1252[32] = {
+  0x20AC, 0x0000, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+  0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x0000, 0x017D, 0x0000,
+  0x0000, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+  0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x0000, 0x017E, 0x0178
+};
+
+static void encodeByte(string &out, unsigned char b)
+{
+  char hex[5];
+  sprintf(hex, "<%02x>", b);
+  out.append(hex);
+}
+
+void encodeString(SEXP c, uint8_t release, string &out)
+{
+  const char * s = CHAR(c);
+  size_t const n = LENGTH(c);
+
+  bool ascii = true;
+  for (size_t i = 0; i < n && ascii; ++i)
+    ascii = !(s[i] & 0x80);
+
+  if (ascii)
+  {
+    out.assign(s, n);
+    return;
+  }
+
+  const unsigned char * u = (const unsigned char *)Rf_translateCharUTF8(c);
+  if (release != 117)
+  {
+    out.assign((const char *)u);
+    return;
+  }
+
+  out.clear();
+  while (*u)
+  {
+    // decode one UTF-8 sequence
+    uint32_t cp = *u;
+    int len = 1;
+    if (cp >= 0xF0) { cp &= 0x07; len = 4; }
+    else if (cp >= 0xE0) { cp &= 0x0F; len = 3; }
+    else if (cp >= 0xC0) { cp &= 0x1F; len = 2; }
+
+    bool valid = !(*u >= 0x80 && *u < 0xC0);
+    for (int i = 1; i < len && valid; ++i)
+    {
+      valid = (u[i] & 0xC0) == 0x80;
+      cp = (cp << 6) | (u[i] & 0x3F);
+    }
+    if (!valid)
+    {
+      encodeByte(out, *u++);
+      continue;
+    }
+
+    int b = -1;
+    if (cp < 0x80 || (cp >= 0xA0 && cp <= 0xFF))
+      b = cp;
+    for (int i = 0; i < 32 && b < 0; ++i)
+      if (cp1252[i] == cp)
+        b = 0x80 + i;
+
+    if (b >= 0)
+      out.push_back((char)b);
+    else
+      for (int i = 0; i < len; ++i)
+        encodeByte(out, u[i]);
+    u += len;
+  }
+}
+
+static string encodeString(SEXP c, uint8_t release)
+{
+  string out;
+  encodeString(c, release, out);
+  return out;
+}
+
+/* Strings of a variable encoded once. str# keep their bytes one
+ * after another with the end of each, strLs their references (see
+ * dtaStrlRef).
+ */
+struct dtaStrCol
+{
+  string bytes;
+  std::vector<size_t> end;
+  std::vector<uint64_t> ref;
+};
+
+/* State of a dta-file while it is written. stataWrite() uses it once, the
+ * chunked writer keeps it in an external pointer between the calls of
+ * stataWriteOpen(), stataWriteChunk() and stataWriteClose(). The bytes
+ * themselves go to a sink (see statasinks.h).
+ */
+struct dtaWriter
+{
+  uint8_t release;
+  uint32_t k;
+  uint64_t n;
+  std::vector<int32_t> vartypes;
+
+  /* new files are written in native byte order, modified ones keep theirs */
+  bool swapit;
+
+  /* byte position of N and of the 14 sections in <map> */
+  uint64_t npos;
+  std::vector<uint64_t> map;
+
+  /* bytes per observation in <data> */
+  uint64_t rowlen;
+
+  uint8_t nvarnameslen, nformatslen, nvalLabelslen, lbllen;
+  uint16_t nvarLabelslen;
+  int32_t chlen;
+
+  /* strLs are hashed by their content. Each distinct value is written only
+   * once to <strls>, repeated values share the (v,o) of their first
+   * occurrence. strlhash maps a hash to all positions in REF and STRL with
+   * this hash, so collisions are resolved by comparing the strings.
+   */
+  std::vector<uint64_t> REF;
+  std::vector<string> STRL;
+  std::multimap<uint64_t, size_t> strlhash;
+
+  /* label sets created from the levels of factors */
+  std::vector<string> factorlabnames;
+  std::vector<CharacterVector> factorlevels;
+
+  /* encoded strings of the variables: of all rows in stataWrite(), of the
+   * current chunk in stataWriteChunk()
+   */
+  std::vector<dtaStrCol> strcols;
+
+  dtaWriter() : release(0), k(0), n(0), swapit(::swapit), npos(0),
+  map(14, 0), rowlen(0) {}
+};
+
+/* raw vector of the final file size. Used to create a dta-file in memory */
+class RawSink
+{
+public:
+  RawSink(RawVector raw) : raw(raw), buf((char*)RAW(raw)), size(raw.size()),
+  pos(0) {}
+  void write(const char * s, uint64_t n)
+  {
+    if (pos + n > size)
+      throw std::range_error("Raw vector is too small for the dta-file.");
+    dtaProf.io(n);
+    memcpy(buf + pos, s, n);
+    pos += n;
+  }
+  uint64_t tell() { return pos; }
+
+private:
+  RawVector raw;
+  char * buf;
+  uint64_t size;
+  uint64_t pos;
+};
+
+/* chunked writer: the state and its open file */
+struct dtaChunkWriter
+{
+  dtaWriter w;
+  FileSink dta;
+};
+
+template <typename Sink>
+static void writeN(dtaWriter &w, Sink &dta)
+{
+  if (w.release==117)
+    writebin((int32_t)w.n, dta, swapit);
+  else
+    writebin(w.n, dta, swapit);
+}
+
+/* Returns the (v,o) reference of a strL. If val_strl was seen before, ref is
+ * replaced by the reference of its first occurrence.
+ */
+static void addStrl(dtaWriter &w, const string &val_strl, uint64_t &ref)
+{
+  uint64_t h = strlfnv(val_strl);
+
+  // duplicate: reference the first occurrence
+  typedef std::multimap<uint64_t, size_t>::const_iterator hit;
+  std::pair<hit, hit> range = w.strlhash.equal_range(h);
+  for (hit it = range.first; it != range.second; ++it)
+  {
+    if (w.STRL[it->second] == val_strl)
+    {
+      ref = w.REF[it->second];
+      return;
+    }
+  }
+
+  w.strlhash.insert(std::make_pair(h, w.STRL.size()));
+  w.REF.push_back(ref);
+  w.STRL.push_back(val_strl);
+}
+
+/* Writes <characteristics> ... </characteristics>. Each element of chs holds
+ * variable name, characteristic name and its contents.
+ */
+template <typename Sink>
+static void writeCharacteristics(dtaWriter &w, Sink &dta, List chs)
+{
+  const string startcharacteristics = "<characteristics>";
+  const string endcharacteristics = "</characteristics>";
+
+  const string startch = "<ch>";
+  const string endch = "</ch>";
+
+  int32_t const chlen = w.chlen;
+
+  dta.write(startcharacteristics.c_str(),startcharacteristics.size());
+  /* <ch> ... </ch> */
+
+  if (chs.size()>0){
+    for (int32_t i = 0; i<chs.size(); ++i){
+
+      dta.write(startch.c_str(),startch.size());
+
+      CharacterVector ch = as<CharacterVector>(chs[i]);
+
+      string ch1 = encodeString(STRING_ELT(ch, 0), w.release);
+      ch1.resize(chlen, '\0');
+      string ch2 = encodeString(STRING_ELT(ch, 1), w.release);
+      ch2.resize(chlen, '\0');
+      string ch3 = encodeString(STRING_ELT(ch, 2), w.release);
+
+      uint32_t nnocharacter = chlen*2 + ch3.size() +1;
+      writebin(nnocharacter, dta, w.swapit);
+
+      dta.write(ch1.c_str(),chlen);
+      dta.write(ch2.c_str(),chlen);
+      dta.write(ch3.c_str(),ch3.size()+1);
+
+      dta.write(endch.c_str(),endch.size());
+    }
+  }
+
+  dta.write(endcharacteristics.c_str(),endcharacteristics.size());
+}
+
+/* Encodes the strings of x once into col */
+static size_t encodeColumn(dtaWriter &w, CharacterVector x, dtaStrCol &col,
+                           dtaProgress &progress)
+{
+  R_xlen_t const n = x.size();
+  size_t maxlen = 0;
+  string val;
+
+  col.bytes.clear();
+  col.end.resize(n);
+  for (R_xlen_t j = 0; j < n; ++j)
+  {
+    progress.add(8);
+    encodeString(STRING_ELT(x, j), w.release, val);
+    maxlen = std::max(maxlen, val.size());
+    col.bytes += val;
+    col.end[j] = col.bytes.size();
+  }
+  return maxlen;
+}
+
+/* Replaces the bytes of strL variable i by the references of its strLs.
+ * Observation numbers continue after the first, already written, offset rows.
+ */
+static void collectStrl(dtaWriter &w, uint32_t i, dtaStrCol &col,
+                        uint64_t offset)
+{
+  size_t const n = col.end.size();
+  col.ref.resize(n);
+
+  size_t begin = 0;
+  for (size_t j = 0; j < n; ++j)
+  {
+    /* Stata uses +1 */
+    uint64_t ref = dtaStrlRef(i+1, offset+j+1, w.release);
+    if (col.end[j] > begin)
+      addStrl(w, col.bytes.substr(begin, col.end[j] - begin), ref);
+    else
+      ref = 0;
+    col.ref[j] = ref;
+    begin = col.end[j];
+  }
+
+  string().swap(col.bytes);
+  std::vector<size_t>().swap(col.end);
+}
+
+/* Sets the types of the variables from the attribute types. Strings are
+ * encoded once: a type of 0 is derived from the longest string, str1 to
+ * str2045 or strL beyond. With keep the strings are kept for writeData(),
+ * otherwise dat serves as schema only.
+ */
+static void setTypes(dtaWriter &w, Rcpp::DataFrame dat, bool keep)
+{
+  List vartypes = dat.attr("types");
+  CharacterVector names = dat.attr("names");
+  const string version = dat.attr("version");
+
+  uint32_t const k = dat.size();
+
+  w.release = atoi(version.c_str());
+  w.vartypes.resize(k);
+  w.strcols.assign(k, dtaStrCol());
+  w.rowlen = 0;
+
+  dtaProgress progress(NULL, 0);
+
+  for (uint32_t i = 0; i < k; ++i)
+  {
+    int32_t type = as<int32_t>(vartypes[i]);
+
+    if (type <= 2045 || type == 32768)
+    {
+      size_t const maxlen = encodeColumn(w, as<CharacterVector>(dat[i]),
+                                         w.strcols[i], progress);
+
+      if (type == 0)
+        type = maxlen < 2045 ? maxlen + 1 : 32768;
+      else if (type <= 2045 && maxlen > (size_t)type)
+        throw std::range_error("Strings in " + as<string>(names[i]) +
+                               " are longer than their string width.");
+
+      if (keep && type == 32768)
+        collectStrl(w, i, w.strcols[i], 0);
+    }
+
+    w.vartypes[i] = type;
+    w.rowlen += dtaWidth(type);
+  }
+
+  if (!keep)
+    w.strcols.clear();
+}
+
+/* Encodes the strings of a chunk for writeData(). All are checked against
+ * the widths of the schema before a strL is collected or a row written.
+ */
+static void encodeChunk(dtaWriter &w, Rcpp::DataFrame dat, uint64_t offset)
+{
+  if (dat.size() != (R_xlen_t)w.k)
+    throw std::range_error("Number of variables does not match.");
+
+  CharacterVector names = dat.attr("names");
+  dtaProgress progress(NULL, 0);
+
+  w.strcols.assign(w.k, dtaStrCol());
+  for (uint32_t i = 0; i < w.k; ++i)
+  {
+    int32_t const type = w.vartypes[i];
+    if (type > 2045 && type != 32768)
+      continue;
+
+    size_t const maxlen = encodeColumn(w, as<CharacterVector>(dat[i]),
+                                       w.strcols[i], progress);
+    if (type <= 2045 && maxlen > (size_t)type)
+      throw std::range_error("Strings in " + as<string>(names[i]) +
+                             " are longer than the string width of the schema.");
+  }
+
+  for (uint32_t i = 0; i < w.k; ++i)
+    if (w.vartypes[i] == 32768)
+      collectStrl(w, i, w.strcols[i], offset);
+}
+
+/* Writes everything from <stata_dta> to <data>. Types are those of setTypes(),
+ * names, formats, labels and characteristics are taken from the attributes of
+ * dat. N is written as
+ * nrows(dat) and <map> as currently stored in w.map. If they are not known
+ * in advance, patchHeader() rewrites them.
+ */
+template <typename Sink>
+static void writeHeader(dtaWriter &w, Sink &dta, Rcpp::DataFrame dat)
+{
+  uint32_t k = dat.size();
 
   const string timestamp = dat.attr("timestamp");
-  string datalabel = dat.attr("datalabel");
-  datalabel[datalabel.size()] = '\0';
+  CharacterVector datalabelCV = dat.attr("datalabel");
 
   CharacterVector valLabels = dat.attr("vallabels");
   CharacterVector nvarnames = dat.attr("names");
 
   List chs = dat.attr("expansion.fields");
   List formats = dat.attr("formats");
-  List labeltable = dat.attr("label.table");
   List varLabels = dat.attr("var.labels");
-  List vartypes = dat.attr("types");
+
+  // variable numbers (starting with 1) of the sort variables
+  IntegerVector sortlist;
+  if (!Rf_isNull(dat.attr("sortlist")))
+    sortlist = dat.attr("sortlist");
 
   const string version = dat.attr("version");
 
@@ -90,6 +486,7 @@ int stataWrite(const char * filePath, Rcpp::DataFrame dat)
     lbllen = 33;
     break;
   case 118:
+  case 119:
     nvarnameslen = 129;
     nformatslen = 57;
     nvalLabelslen = 129;
@@ -99,6 +496,36 @@ int stataWrite(const char * filePath, Rcpp::DataFrame dat)
     break;
   }
 
+  // K is stored in 2 bytes up to 118
+  if (release < 119 && k > 32767)
+    throw std::range_error("Version 117 and 118 allow at most 32767 variables. Use version 119.");
+
+  string datalabel = encodeString(STRING_ELT(datalabelCV, 0), release);
+
+  w.release = release;
+  w.k = k;
+  w.n = dat.nrows();
+  w.nvarnameslen = nvarnameslen;
+  w.nformatslen = nformatslen;
+  w.nvalLabelslen = nvalLabelslen;
+  w.nvarLabelslen = nvarLabelslen;
+  w.chlen = chlen;
+  w.lbllen = lbllen;
+
+  /* factors with a value label name get a label set from their levels */
+  w.factorlabnames.clear();
+  w.factorlevels.clear();
+  for (uint32_t i = 0; i < k; ++i)
+  {
+    SEXP x = dat[i];
+    const string labname = encodeString(STRING_ELT(valLabels, i), release);
+    if (Rf_isFactor(x) && !labname.empty())
+    {
+      w.factorlabnames.push_back(labname);
+      w.factorlevels.push_back(Rf_getAttrib(x, R_LevelsSymbol));
+    }
+  }
+
   const string head = "<stata_dta><header><release>";
   const string byteord = "</release><byteorder>";
   const string K = "</byteorder><K>";
@@ -128,437 +555,852 @@ int stataWrite(const char * filePath, Rcpp::DataFrame dat)
   const string startvarlabel= "<variable_labels>";
   const string endvarlabel= "</variable_labels>";
 
-  const string startcharacteristics = "<characteristics>";
-  const string endcharacteristics = "</characteristics>";
+  const string startdata = "<data>";
 
-  const string startch = "<ch>";
-  const string endch = "</ch>";
+  /* Stata 13 uses <map> to store 14 byte positions in a dta-file. stataWrite()
+  * computes them before writing, the chunked writer fills them in while
+  * writing and rewrites <map> once all 14 values are known.
+  */
+  std::vector<uint64_t> &map = w.map;
+  map[0] = dta.tell();
+
+  dta.write(head.c_str(),head.size());
+  dta.write(version.c_str(),3); // 117|118|119 (e.g. Stata 13|14|15)
+  dta.write(byteord.c_str(),byteord.size());
+  dta.write(byteorder,3); // LSF
+  dta.write(K.c_str(),K.size());
+  if (release==119)
+    writebin(k, dta, swapit);
+  else
+    writebin((uint16_t)k, dta, swapit);
+  dta.write(num.c_str(),num.size());
+  w.npos = dta.tell();
+  writeN(w, dta);
+  dta.write(lab.c_str(),lab.size());
 
-  const string startdata = "<data>";
-  const string enddata = "</data>";
 
-  const string startstrl = "<strls>";
-  const string endstrl = "</strls>";
+  /* write a datalabel */
+  if(!datalabel.empty())
+  {
+    ndlabel = datalabel.size();
+    if (release==117)
+      writebin((uint8_t)ndlabel, dta, swapit);
+    else
+      writebin(ndlabel, dta, swapit);
+    dta.write(datalabel.c_str(),datalabel.size());
+  } else {
+    dta.write((char*)&ndlabel,sizeof(ndlabel));
+  }
 
-  const string startvall = "<value_labels>";
-  const string endvall = "</value_labels>";
 
-  const string startlbl = "<lbl>";
-  const string endlbl = "</lbl>";
+  /* timestamp size is 0 (= no timestamp) or 17 */
+  dta.write(timest.c_str(),timest.size());
+  if (!timestamp.empty()) {
+    ntimestamp = 17;
+    writebin(ntimestamp, dta, swapit);
+    dta.write(timestamp.c_str(),timestamp.size());
+  }else{
+    writebin(ntimestamp, dta, swapit);
+  }
+  dta.write(endheader.c_str(),endheader.size());
 
-  string end = "</stata_dta>";
-  end[end.size()] = '\0';
+  /* <map> ... </map> */
+  map[1] = dta.tell();
+  dta.write(startmap.c_str(),startmap.size());
+  for (int32_t i = 0; i <14; ++i)
+  {
+    uint64_t nmap = map[i];
+    writebin(nmap, dta, swapit);
+  }
+  dta.write(endmap.c_str(),endmap.size());
 
-  fstream dta (filePath, ios::out | ios::binary);
-  if (dta.is_open())
-  {
-    /* Stata 13 uses <map> to store 14 byte positions in a dta-file. This
-    * vector is now created and filled with the correct map positions. At
-    * the end of the creation process, all 14 values are known and map will
-    * be filled with the correct values.
-    */
-    IntegerVector map(14);
-    map(0) = dta.tellg();
-
-    dta.write(head.c_str(),head.size());
-    dta.write(version.c_str(),3); // 117|118 (e.g. Stata 13|14)
-    dta.write(byteord.c_str(),byteord.size());
-    dta.write(byteorder,3); // LSF
-    dta.write(K.c_str(),K.size());
-    writebin(k, dta, swapit);
-    dta.write(num.c_str(),num.size());
-    if (release==117)
-      writebin((int32_t)n, dta, swapit);
-    if (release==118)
-      writebin(n, dta, swapit);
-    dta.write(lab.c_str(),lab.size());
+  /* <variable_types> ... </variable_types> */
+  map[2] = dta.tell();
+  dta.write(startvart.c_str(),startvart.size());
+  uint16_t nvartype;
+  for (uint32_t i = 0; i < k; ++i)
+  {
+    nvartype = w.vartypes[i];
 
+    writebin(nvartype, dta, swapit);
+  }
+  dta.write(endvart.c_str(),endvart.size());
 
-    /* write a datalabel */
-    if(!datalabel.empty())
-    {
-      ndlabel = datalabel.size();
-      if (release==117)
-        writebin((uint8_t)ndlabel, dta, swapit);
-      if (release==118)
-        writebin(ndlabel, dta, swapit);
-      dta.write(datalabel.c_str(),datalabel.size());
-    } else {
-      dta.write((char*)&ndlabel,sizeof(ndlabel));
-    }
 
+  /* <varnames> ... </varnames> */
+  map[3] = dta.tell();
+  dta.write(startvarn.c_str(), startvarn.size());
+  for (uint32_t i = 0; i < k; ++i )
+  {
+    string nvarname = encodeString(STRING_ELT(nvarnames, i), release);
+    nvarname.resize(nvarnameslen, '\0');
+    dta.write(nvarname.c_str(),nvarnameslen);
+  }
+  dta.write(endvarn.c_str(), endvarn.size());
 
-    /* timestamp size is 0 (= no timestamp) or 17 */
-    dta.write(timest.c_str(),timest.size());
-    if (!timestamp.empty()) {
-      ntimestamp = 17;
-      writebin(ntimestamp, dta, swapit);
-      dta.write(timestamp.c_str(),timestamp.size());
-    }else{
-      writebin(ntimestamp, dta, swapit);
-    }
-    dta.write(endheader.c_str(),endheader.size());
 
-    /* <map> ... </map> */
-    map(1) = dta.tellg();
-    dta.write(startmap.c_str(),startmap.size());
-    for (int32_t i = 0; i <14; ++i)
-    {
-      uint64_t nmap = 0;
-      writebin(nmap, dta, swapit);
-    }
-    dta.write(endmap.c_str(),endmap.size());
+  /* <sortlist> ... </sortlist> */
+  map[4] = dta.tell();
+  dta.write(startsor.c_str(),startsor.size());
 
-    /* <variable_types> ... </variable_types> */
-    map(2) = dta.tellg();
-    dta.write(startvart.c_str(),startvart.size());
-    uint16_t nvartype;
-    for (uint16_t i = 0; i < k; ++i)
-    {
-      nvartype = as<uint16_t>(vartypes[i]);
+  uint32_t big_k = k+1;
 
-      writebin(nvartype, dta, swapit);
-    }
-    dta.write(endvart.c_str(),endvart.size());
+  // variable numbers are stored in 4 bytes in 119
+  for (uint32_t i = 0; i < big_k; ++i)
+  {
+    uint32_t nsortlist = 0;
+    if (i < (uint32_t)sortlist.size())
+      nsortlist = sortlist[i];
+    if (release==119)
+      writebin(nsortlist, dta, swapit);
+    else
+      writebin((uint16_t)nsortlist, dta, swapit);
+  }
+  dta.write(endsor.c_str(),endsor.size());
 
 
-    /* <varnames> ... </varnames> */
-    map(3) = dta.tellg();
-    dta.write(startvarn.c_str(), startvarn.size());
-    for (uint16_t i = 0; i < k; ++i )
+  /* <formats> ... </formats> */
+  map[5] = dta.tell();
+  dta.write(startform.c_str(),startform.size());
+  for (uint32_t i = 0; i < k; ++i )
+  {
+    string nformats = as<string>(formats[i]);
+    // strings with a derived width
+    if (nformats.empty())
     {
-      const string nvarname = as<string>(nvarnames[i]);
-      dta.write(nvarname.c_str(),nvarnameslen);
+      char fmt[16] = "%9s";
+      if (w.vartypes[i] <= 2045)
+        snprintf(fmt, sizeof fmt, "%%-%ds", (int)w.vartypes[i]);
+      nformats = fmt;
     }
-    dta.write(endvarn.c_str(), endvarn.size());
+    nformats.resize(nformatslen, '\0');
+    dta.write(nformats.c_str(),nformatslen);
+  }
+  dta.write(endform.c_str(),endform.size());
 
 
-    /* <sortlist> ... </sortlist> */
-    map(4) = dta.tellg();
-    dta.write(startsor.c_str(),startsor.size());
+  /* <value_label_names> ... </value_label_names> */
+  map[6] = dta.tell();
+  dta.write(startvalLabel.c_str(),startvalLabel.size());
+  for (uint32_t i = 0; i < k; ++i )
+  {
+    string nvalLabels = encodeString(STRING_ELT(valLabels, i), release);
+    nvalLabels.resize(nvalLabelslen, '\0');
+    dta.write(nvalLabels.c_str(), nvalLabelslen);
+  }
+  dta.write(endvalLabel.c_str(),endvalLabel.size());
 
-    uint32_t big_k = k+1;
 
-    for (uint32_t i = 0; i < big_k; ++i)
-    {
-      uint16_t nsortlist = 0;
-      writebin(nsortlist, dta, swapit);
+  /* <variable_labels> ... </variable_labels> */
+  map[7] = dta.tell();
+  dta.write(startvarlabel.c_str(),startvarlabel.size());
+  for (uint32_t i = 0; i < k; ++i)
+  {
+    if (!Rf_isNull(varLabels) && Rf_length(varLabels) > 1) {
+      CharacterVector varLabel = varLabels[i];
+      string nvarLabels = encodeString(STRING_ELT(varLabel, 0), release);
+      nvarLabels.resize(nvarLabelslen, '\0');
+      dta.write(nvarLabels.c_str(),nvarLabelslen);
+    } else {
+      const string nvarLabels = "";
+      dta.write(nvarLabels.c_str(),nvarLabelslen);
     }
-    dta.write(endsor.c_str(),endsor.size());
+  }
+  dta.write(endvarlabel.c_str(),endvarlabel.size());
 
 
-    /* <formats> ... </formats> */
-    map(5) = dta.tellg();
-    dta.write(startform.c_str(),startform.size());
-    for (uint16_t i = 0; i < k; ++i )
-    {
-      const string nformats = as<string>(formats[i]);
-      dta.write(nformats.c_str(),nformatslen);
-    }
-    dta.write(endform.c_str(),endform.size());
+  /* <characteristics> ... </characteristics> */
+  map[8] = dta.tell();
+  writeCharacteristics(w, dta, chs);
 
 
-    /* <value_label_names> ... </value_label_names> */
-    map(6) = dta.tellg();
-    dta.write(startvalLabel.c_str(),startvalLabel.size());
-    for (uint16_t i = 0; i < k; ++i )
-    {
-      const string nvalLabels = as<string>(valLabels[i]);
-      dta.write(nvalLabels.c_str(), nvalLabelslen);
-    }
-    dta.write(endvalLabel.c_str(),endvalLabel.size());
+  /* <data> ... </data> */
+  map[9] = dta.tell();
+  dta.write(startdata.c_str(),startdata.size());
+}
+
+/* Appends the rows of dat to <data>. Strings are those encoded by setTypes()
+ * or encodeChunk().
+ */
+template <typename Sink>
+static void writeData(dtaWriter &w, Sink &dta, Rcpp::DataFrame dat)
+{
+  uint32_t k = w.k;
+  uint64_t n = dat.nrows();
+
+  if (dat.size() != (R_xlen_t)k)
+    throw std::range_error("Number of variables does not match.");
+
+  // variables in the storage mode of their type
+  List cols(k);
+  for (uint32_t i = 0; i < k; ++i)
+  {
+    int const type = w.vartypes[i];
+    if (type >= 65528)
+      cols[i] = as<IntegerVector>(dat[i]);
+    else if (type >= 65526)
+      cols[i] = as<NumericVector>(dat[i]);
+  }
+
+  // blocks of observations are encoded column by column (see dtacore.h)
+  dtaEncoder enc(w.vartypes, w.release, swapit);
+  uint64_t const block = w.rowlen > 0 && w.rowlen < (1 << 20) ?
+    (1 << 20) / w.rowlen : 1;
 
+  std::vector<const char *> s;
+  std::vector<size_t> len;
+  dtaProgress progress("writing data", n * w.rowlen);
+
+  for (uint64_t j = 0; j < n; )
+  {
+    uint64_t const m = (n - j < block) ? n - j : block;
+    enc.begin(m);
 
-    /* <variable_labels> ... </variable_labels> */
-    map(7) = dta.tellg();
-    dta.write(startvarlabel.c_str(),startvarlabel.size());
-    for (uint16_t i = 0; i < k; ++i)
+    for (uint32_t i = 0; i < k; ++i)
     {
-      if (!Rf_isNull(varLabels) && Rf_length(varLabels) > 1) {
-        const string nvarLabels = as<std::string>(varLabels[i]);
-        dta.write(nvarLabels.c_str(),nvarLabelslen);
-      } else {
-        const string nvarLabels = "";
-        dta.write(nvarLabels.c_str(),nvarLabelslen);
+      int const type = w.vartypes[i];
+      SEXP x = cols[i];
+
+      switch(type < 2046 ? 2045 : type)
+      {
+        // double and float
+      case 65526:
+      case 65527:
+        enc.doubles(i, REAL(x) + j);
+        break;
+        // long, int and byte
+      case 65528:
+      case 65529:
+      case 65530:
+        enc.ints(i, INTEGER(x) + j);
+        break;
+      case 2045:
+      {
+        const dtaStrCol &col = w.strcols[i];
+        s.resize(m);
+        len.resize(m);
+        for (uint64_t r = 0; r < m; ++r)
+        {
+          size_t const begin = j + r > 0 ? col.end[j + r - 1] : 0;
+          s[r] = col.bytes.data() + begin;
+          len[r] = col.end[j + r] - begin;
+        }
+        enc.strings(i, &s[0], &len[0]);
+        break;
+      }
+      case 32768:
+        enc.strls(i, &w.strcols[i].ref[j]);
+        break;
       }
     }
-    dta.write(endvarlabel.c_str(),endvarlabel.size());
 
+    dtaProf.buffer(enc.size());
+    dta.write(enc.data(), enc.size());
+    j += m;
+    progress.add(m * w.rowlen);
+  }
+  progress.finish();
+}
 
-    /* <characteristics> ... </characteristics> */
-    map(8) = dta.tellg();
-    dta.write(startcharacteristics.c_str(),startcharacteristics.size());
-    /* <ch> ... </ch> */
+/* Writes a single label set <lbl> ... </lbl>. Offsets and txtlen are computed
+ * ahead from the label texts.
+ */
+template <typename Sink>
+static void writeLbl(dtaWriter &w, Sink &dta, const string &labname,
+                     const std::vector<int32_t> &code,
+                     const std::vector<const char*> &text)
+{
+  const string startlbl = "<lbl>";
+  const string endlbl = "</lbl>";
 
-    if (chs.size()>0){
-      for (int32_t i = 0; i<chs.size(); ++i){
+  int8_t padding = 0;
+  int32_t N = code.size();
 
-        dta.write(startch.c_str(),startch.size());
+  /*
+  * Fill off with offset position and create txtlen
+  */
+  std::vector<int32_t> off(N), len(N);
+  int32_t txtlen = 0;
+  for (int32_t i = 0; i < N; ++i)
+  {
+    len[i] = strlen(text[i]) +1;
+    off[i] = txtlen;
+    txtlen += len[i];
+  }
 
-        CharacterVector ch = as<CharacterVector>(chs[i]);
+  int32_t nlen = sizeof(N) + sizeof(txtlen) + sizeof(int32_t)*N*2 + txtlen;
 
-        string ch1 = as<string>(ch[0]);
-        ch1[ch1.size()] = '\0';
-        string ch2 = as<string>(ch[1]);
-        ch2[ch2.size()] = '\0';
-        string ch3 = as<string>(ch[2]);
-        ch3[ch3.size()] = '\0';
+  string nlabname = labname;
+  nlabname.resize(w.lbllen, '\0');
 
-        uint32_t nnocharacter = chlen*2 + ch3.size() +1;
-        writebin(nnocharacter, dta, swapit);
+  dta.write(startlbl.c_str(),startlbl.size());
+  writebin(nlen, dta, w.swapit);
+  dta.write(nlabname.c_str(),w.lbllen);
+  dta.write((char*)&padding,1);
+  dta.write((char*)&padding,1);
+  dta.write((char*)&padding,1);
+  writebin(N, dta, w.swapit);
+  writebin(txtlen, dta, w.swapit);
 
-        dta.write(ch1.c_str(),chlen);
-        dta.write(ch2.c_str(),chlen);
-        dta.write(ch3.c_str(),ch3.size()+1);
+  for (int32_t i = 0; i < N; ++i)
+    writebin(off[i], dta, w.swapit);
 
-        dta.write(endch.c_str(),endch.size());
-      }
-    }
+  for (int32_t i = 0; i < N; ++i)
+    writebin(code[i], dta, w.swapit);
 
-    dta.write(endcharacteristics.c_str(),endcharacteristics.size());
+  // label text including the binary 0
+  for (int32_t i = 0; i < N; ++i)
+    dta.write(text[i],len[i]);
 
+  dta.write(endlbl.c_str(),endlbl.size());
+}
 
-    /* <data> ... </data> */
-    map(9) = dta.tellg();
-    dta.write(startdata.c_str(),startdata.size());
+/* Writes a label set for each element of labeltable, a named integer vector
+ * of codes with the label texts as names.
+ */
+template <typename Sink>
+static void writeLabelTable(dtaWriter &w, Sink &dta, List labeltable)
+{
+  std::vector<int32_t> code;
+  std::vector<string> enc;
+  std::vector<const char*> text;
 
-    IntegerVector V, O;
-    CharacterVector STRL;
+  if (labeltable.size()>0)
+  {
+    CharacterVector labnames = labeltable.attr("names");
 
-    for(uint32_t j = 0; j < n; ++j)
+    for (int32_t i=0; i < labnames.size(); ++i)
     {
-      for (uint16_t i = 0; i < k; ++i)
+      IntegerVector labvalue = as<IntegerVector>(labeltable[i]);
+      CharacterVector labelText = labvalue.attr("names");
+      int32_t N = labvalue.size();
+
+      code.assign(labvalue.begin(), labvalue.end());
+      enc.resize(N);
+      text.resize(N);
+      for (int32_t j = 0; j < N; ++j)
       {
-        int const type = vartypes[i];
-        switch(type < 2046 ? 2045 : type)
-        {
-          // store numeric as Stata double (double)
-        case 65526:
-        {
-          double val_d = as<NumericVector>(dat[i])[j];
+        encodeString(STRING_ELT(labelText, j), w.release, enc[j]);
+        text[j] = enc[j].c_str();
+      }
 
-          if ( (val_d == NA_REAL) | R_IsNA(val_d) )
-            val_d = STATA_DOUBLE_NA;
+      writeLbl(w, dta, encodeString(STRING_ELT(labnames, i), w.release),
+               code, text);
+    }
+  }
+}
 
-          writebin(val_d, dta, swapit);
+/* Progress is reported while writing, not while counting */
+template <typename Sink>
+static const char * progressPhase(Sink &, const char * phase)
+{
+  return phase;
+}
 
-          break;
-        }
-          // float
-        case 65527:
-        {
-          double val_d = as<NumericVector>(dat[i])[j];
-          float val_f = (double)(val_d);
+static const char * progressPhase(CountSink &, const char *)
+{
+  return NULL;
+}
 
-          if ( (val_d == NA_REAL) | (R_IsNA(val_d)) )
-            val_f = STATA_FLOAT_NA;
+/* Writes everything after the last row: </data>, <strls> and <value_labels>.
+ */
+template <typename Sink>
+static void writeTail(dtaWriter &w, Sink &dta, List labeltable)
+{
+  std::vector<uint64_t> &map = w.map;
 
-          writebin(val_f, dta, swapit);
+  const string enddata = "</data>";
 
-          break;
-        }
-          // store integer as Stata long (int32_t)
-        case 65528:
-        {
-          int32_t val_l = as<IntegerVector>(dat[i])[j];
+  const string startstrl = "<strls>";
+  const string endstrl = "</strls>";
 
-          if ( (val_l == NA_INTEGER) | (R_IsNA(val_l)) )
-            val_l = STATA_INT_NA;
+  const string startvall = "<value_labels>";
+  const string endvall = "</value_labels>";
 
-          writebin(val_l, dta, swapit);
+  string end = "</stata_dta>";
+  end[end.size()] = '\0';
 
-          break;
-        }
-          // int
-        case 65529:
-        {
-          union v {
-            int32_t   l;
-            int16_t   i;
-          } val;
+  dta.write(enddata.c_str(),enddata.size());
 
-          val.l = as<IntegerVector>(dat[i])[j];
 
-          int16_t val_i = val.i;
+  /* <strls> ... </strls> */
+  map[10] = dta.tell();
+  dta.write(startstrl.c_str(),startstrl.size());
 
-          if (val.l == NA_INTEGER)
-            val_i = STATA_SHORTINT_NA;
+  size_t const gsosize = dtaGsoSize(w.release);
+  uint64_t strlbytes = 0;
+  for (size_t i = 0; i < w.STRL.size(); ++i)
+    strlbytes += w.STRL[i].size() + gsosize + 3;
+  dtaProgress progress(progressPhase(dta, "writing strls"), strlbytes);
 
-          writebin(val_i, dta, swapit);
+  const string gso = "GSO";
+  char gsohead[32];
+  for (size_t i = 0; i < w.STRL.size(); ++i)
+  {
+    const string &strL = w.STRL[i];
+    dtaGso g;
+    g.ref = w.REF[i];
+    g.t = 129; //Stata binary type, no trailing zero.
+    g.len = strL.size();
+
+    dta.write(gso.c_str(),gso.size());
+    dtaEncodeGso(gsohead, g, w.release, swapit);
+    dta.write(gsohead, gsosize);
+    dta.write(strL.c_str(),strL.size());
+    progress.add(strL.size() + gsosize + 3);
+  }
+  progress.finish();
 
-          break;
-        }
-          // byte
-        case 65530:
-        {
-          union v {
-            int32_t   l;
-            int8_t    b;
-          } val;
+  dta.write(endstrl.c_str(),endstrl.size());
 
-          val.l = as<IntegerVector>(dat[i])[j];
 
-          int8_t val_b = val.b;
+  /* <value_labels> ... </value_labels> */
+  map[11] = dta.tell();
+  dta.write(startvall.c_str(),startvall.size());
 
-          if (val.l == NA_INTEGER)
-            val_b = STATA_BYTE_NA;
+  writeLabelTable(w, dta, labeltable);
 
-          writebin(val_b, dta, swapit);
+  std::vector<int32_t> code;
+  std::vector<string> enc;
+  std::vector<const char*> text;
 
-          break;
-        }
-        case 2045:
-        {
-          int32_t const len = vartypes[i];
-          /* FixMe: Storing the vector in b for each string. */
-          CharacterVector b = as<CharacterVector>(dat[i]);
-          string val_s = as<string>(b[j]);
-          dta.write(val_s.c_str(),len);
-          break;
-        }
-        case 32768:
-        {
-          /* Stata uses +1 */
-          int32_t v = i+1, o = j+1;
-          int64_t z = 0;
-
-          CharacterVector b = as<CharacterVector>(dat[i]);
-          const string val_strl = as<string>(b[j]);
-          if (!val_strl.empty())
-          {
-            writebin(v, dta, swapit);
-            writebin(o, dta, swapit);
-            // push back every v, o and val_strl
-            V.push_back(v);
-            O.push_back(o);
-            STRL.push_back(val_strl);
-          } else {
-            dta.write((char*)&z,sizeof(z));
-          }
-          break;
-        }
-        }
-      }
+  /* factor codes are 1 to nlevels. A level ".." is not labelled */
+  for (size_t i = 0; i < w.factorlabnames.size(); ++i)
+  {
+    CharacterVector levels = w.factorlevels[i];
+    int32_t N = levels.size();
+
+    code.clear();
+    enc.resize(N);
+    text.clear();
+    for (int32_t j = 0; j < N; ++j)
+    {
+      encodeString(STRING_ELT(levels, j), w.release, enc[j]);
+      if (enc[j] == "..")
+        continue;
+      code.push_back(j+1);
+      text.push_back(enc[j].c_str());
     }
-    dta.write(enddata.c_str(),enddata.size());
 
+    writeLbl(w, dta, w.factorlabnames[i], code, text);
+  }
 
-    /* <strls> ... </strls> */
-    map(10) = dta.tellg();
-    dta.write(startstrl.c_str(),startstrl.size());
+  dta.write(endvall.c_str(),endvall.size());
 
-    int32_t strlsize = STRL.length();
-    for(int i =0; i < strlsize; ++i )
-    {
-      const string gso = "GSO";
-      int32_t v = V[i], o = O[i];
-      uint8_t t = 129; //Stata binary type, no trailing zero.
-      const string strL = as<string>(STRL[i]);
-      uint32_t len = strL.size();
-
-      dta.write(gso.c_str(),gso.size());
-      writebin(v, dta, swapit);
-      writebin(o, dta, swapit);
-      writebin(t, dta, swapit);
-      writebin(len, dta, swapit);
-      dta.write(strL.c_str(),strL.size());
-    }
 
-    dta.write(endstrl.c_str(),endstrl.size());
+  /* </stata_data> */
+  map[12] = dta.tell();
+  dta.write(end.c_str(),end.size());
 
 
-    /* <value_labels> ... </value_labels> */
-    map(11) = dta.tellg();
-    dta.write(startvall.c_str(),startvall.size());
-    if (labeltable.size()>0)
-    {
+  /* end-of-file */
+  map[13] = dta.tell();
+}
 
-      CharacterVector labnames = labeltable.attr("names");
-      int8_t padding = 0;
+/* Seeks back to <N> and <map> and rewrites them with the final values.
+ */
+static void patchHeader(dtaWriter &w, FileSink &dta)
+{
+  const string startmap = "<map>";
+  const string endmap = "</map>";
 
-      for (int32_t i=0; i < labnames.size(); ++i)
-      {
-        int32_t txtlen = 0;
+  /* seek up to <N> and write the final number of rows */
+  dta.seek(w.npos);
+  writeN(w, dta);
 
-        const string labname = as<string>(labnames[i]);
-        IntegerVector labvalue = labeltable[labname];
-        int32_t N = labvalue.size();
-        CharacterVector labelText = labvalue.attr("names");
-        IntegerVector off;
+  /* seek up to <map> to rewrite it*/
+  /* <map> ... </map> */
+  dta.seek(w.map[1]);
+  dta.write(startmap.c_str(),startmap.size());
+  for (int i=0; i <14; ++i)
+  {
+    uint64_t nmap = w.map[i];
+    writebin(nmap, dta, swapit);
+  }
+  dta.write(endmap.c_str(),endmap.size());
+}
 
-        /*
-        * Fill off with offset position and create txtlen
-        */
+/* Computes the 14 <map> positions of dat without writing anything. Strings
+ * are encoded and strLs collected by setTypes(), all other sections are
+ * counted by a CountSink.
+ */
+static void layout(dtaWriter &w, Rcpp::DataFrame dat, List labeltable)
+{
+  CountSink count;
 
-        for (int32_t i = 0; i < labelText.size(); ++i)
-        {
-          string label = as<string>(labelText[i]);
-          int32_t labellen = label.size()+1;
-          txtlen += labellen;
-          off.push_back ( txtlen-labellen );
-        }
+  setTypes(w, dat, true);
+  writeHeader(w, count, dat);
+  count.skip(w.rowlen * w.n);
+  writeTail(w, count, labeltable);
+}
 
-        int32_t offI, labvalueI;
+/* Writes dat forward-only to dta. layout() has to be called first.
+ */
+template <typename Sink>
+static void writeDta(dtaWriter &w, Sink &dta, Rcpp::DataFrame dat,
+                     List labeltable)
+{
+  std::vector<uint64_t> map = w.map;
 
-        int32_t nlen = sizeof(N) + sizeof(txtlen) + sizeof(offI)*N + sizeof(labvalueI)*N + txtlen;
+  dtaProf.phase("header");
+  writeHeader(w, dta, dat);
+  dtaProf.phase("data");
+  writeData(w, dta, dat);
+  dtaProf.phase("tail");
+  writeTail(w, dta, labeltable);
 
-        dta.write(startlbl.c_str(),startlbl.size());
-        writebin(nlen, dta, swapit);
-        dta.write(labname.c_str(),lbllen);
-        dta.write((char*)&padding,3);
-        writebin(N, dta, swapit);
-        writebin(txtlen, dta, swapit);
+  if (map != w.map)
+    throw std::range_error("Sections of the dta-file differ from <map>.");
+}
 
-        for (int32_t i = 0; i < N; ++i)
-        {
-          offI = off[i];
-          writebin(offI, dta, swapit);
-        }
+// Writes the binary Stata file
+//
+// The positions in <map> are computed ahead, so the file is written
+// forward-only. This allows writing compressed files directly.
+//
+// @param filePath The full systempath to the dta file you want to export.
+// @param dat an R-Object of class data.frame.
+// @param gzip logical if the file should be gzip compressed.
+// @export
+// [[Rcpp::export]]
+int stataWrite(const char * filePath, Rcpp::DataFrame dat, const bool gzip)
+{
+  dtaWriter w;
+  List labeltable = dat.attr("label.table");
 
-        for (int32_t i = 0; i < N; ++i)
-        {
-          labvalueI = labvalue[i];
-          writebin(labvalueI, dta, swapit);
-        }
+  dtaProfileScope prof(dtaProfileOption(), "layout");
+  layout(w, dat, labeltable);
 
-        for (int32_t i = 0; i < N; ++i)
+  if (gzip) {
+    GzSink dta;
+    if (!dta.open(filePath))
+      throw std::range_error("Unable to open file.");
+    writeDta(w, dta, dat, labeltable);
+    dta.close();
+  } else {
+    FileSink dta;
+    if (!dta.open(filePath))
+      throw std::range_error("Unable to open file.");
+    writeDta(w, dta, dat, labeltable);
+    dta.close();
+  }
+
+  return 0;
+}
+
+// Writes the binary Stata file into a raw vector
+//
+// The size of the raw vector is the final size of the dta-file known from
+// <map>, so no file and no copy is required.
+//
+// @param dat an R-Object of class data.frame.
+// @return raw vector containing the dta-file.
+// [[Rcpp::export]]
+RawVector stataWriteRaw(Rcpp::DataFrame dat)
+{
+  dtaWriter w;
+  List labeltable = dat.attr("label.table");
+
+  dtaProfileScope prof(dtaProfileOption(), "layout");
+  layout(w, dat, labeltable);
+
+  RawVector raw(no_init(w.map[13]));
+  RawSink dta(raw);
+  writeDta(w, dta, dat, labeltable);
+
+  return raw;
+}
+
+// Opens a dta file for chunked writing
+//
+// Writes header and metadata of the dta file. The data.frame dat is used as
+// schema only, its rows are not written.
+//
+// @param filePath The full systempath to the dta file you want to export.
+// @param dat an R-Object of class data.frame with all attributes required by
+//  stataWrite.
+// @return external pointer to the open writer.
+// [[Rcpp::export]]
+SEXP stataWriteOpen(const char * filePath, Rcpp::DataFrame dat)
+{
+  Rcpp::XPtr<dtaChunkWriter> cw(new dtaChunkWriter(), true);
+
+  if (!cw->dta.open(filePath))
+    throw std::range_error("Unable to open file.");
+
+  setTypes(cw->w, dat, false);
+  writeHeader(cw->w, cw->dta, dat);
+  cw->w.n = 0;
+
+  return cw;
+}
+
+// Appends the rows of a data.frame to a dta file opened by stataWriteOpen
+//
+// @param writer external pointer returned by stataWriteOpen.
+// @param dat an R-Object of class data.frame matching the schema.
+// @return number of rows written so far.
+// [[Rcpp::export]]
+double stataWriteChunk(SEXP writer, Rcpp::DataFrame dat)
+{
+  Rcpp::XPtr<dtaChunkWriter> cw(writer);
+
+  if (!cw->dta.is_open())
+    throw std::range_error("Writer is already closed.");
+
+  encodeChunk(cw->w, dat, cw->w.n);
+  writeData(cw->w, cw->dta, dat);
+  cw->w.n += dat.nrows();
+  cw->w.strcols.clear();
+
+  return cw->w.n;
+}
+
+// Finishes a dta file opened by stataWriteOpen
+//
+// Writes strLs and value labels, patches N and <map> and closes the file.
+//
+// @param writer external pointer returned by stataWriteOpen.
+// @param labeltable list of value labels as in attribute label.table.
+// @return number of rows written.
+// [[Rcpp::export]]
+double stataWriteClose(SEXP writer, Rcpp::List labeltable)
+{
+  Rcpp::XPtr<dtaChunkWriter> cw(writer);
+
+  if (!cw->dta.is_open())
+    throw std::range_error("Writer is already closed.");
+
+  writeTail(cw->w, cw->dta, labeltable);
+  patchHeader(cw->w, cw->dta);
+  cw->dta.close();
+
+  return cw->w.n;
+}
+
+/* Orders observations by the sort variables as Stata does: numbers
+ * ascending with missings last, strings bytewise as they are written to the
+ * file (see encodeString, NA is written as "NA").
+ */
+struct dtaSortLess
+{
+  std::vector<SEXP> keys;
+  std::vector< std::vector<string> > str;   // encoded strings of each key
+
+  bool operator()(R_xlen_t a, R_xlen_t b) const
+  {
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+      SEXP x = keys[i];
+      switch(TYPEOF(x))
+      {
+      case STRSXP:
+      {
+        int const cmp = str[i][a].compare(str[i][b]);
+        if (cmp != 0)
+          return cmp < 0;
+        break;
+      }
+      case INTSXP:
+      case LGLSXP:
+      {
+        int const va = INTEGER(x)[a], vb = INTEGER(x)[b];
+        if (va == vb)
+          continue;
+        if (va == NA_INTEGER || vb == NA_INTEGER)
+          return vb == NA_INTEGER;
+        return va < vb;
+      }
+      default:
+      {
+        double const va = REAL(x)[a], vb = REAL(x)[b];
+        bool const naa = ISNAN(va), nab = ISNAN(vb);
+        if (naa || nab)
         {
-          string labtext = as<string>(labelText[i]);
-          labtext[labtext.size()] = '\0';
-          dta.write(labtext.c_str(),labtext.size()+1);
+          if (naa && nab)
+            continue;
+          return nab;
         }
-        dta.write(endlbl.c_str(),endlbl.size());
+        if (va != vb)
+          return va < vb;
+        break;
+      }
       }
-
     }
-    dta.write(endvall.c_str(),endvall.size());
+    return false;
+  }
+};
 
+// Stable order of observations by a list of sort variables
+//
+// @param keys list of variables
+// @param version dta file format version.
+// @return integer vector with the order (starting with 1)
+// [[Rcpp::export]]
+IntegerVector stataSortOrder(List keys, int version)
+{
+  R_xlen_t const n = keys.size() > 0 ? Rf_xlength(keys[0]) : 0;
 
-    /* </stata_data> */
-    map(12) = dta.tellg();
-    dta.write(end.c_str(),end.size());
+  std::vector<R_xlen_t> ord(n);
+  for (R_xlen_t i = 0; i < n; ++i)
+    ord[i] = i;
 
+  dtaSortLess less;
+  less.str.resize(keys.size());
+  for (R_xlen_t i = 0; i < keys.size(); ++i)
+  {
+    SEXP x = keys[i];
+    less.keys.push_back(x);
+    if (TYPEOF(x) != STRSXP)
+      continue;
+    less.str[i].resize(n);
+    for (R_xlen_t j = 0; j < n; ++j)
+      encodeString(STRING_ELT(x, j), version, less.str[i][j]);
+  }
 
-    /* end-of-file */
-    map(13) = dta.tellg();
+  std::stable_sort(ord.begin(), ord.end(), less);
 
+  IntegerVector res(n);
+  for (R_xlen_t i = 0; i < n; ++i)
+    res[i] = ord[i] + 1;
+  return res;
+}
 
-    /* seek up to <map> to rewrite it*/
-    /* <map> ... </map> */
-    dta.seekg(map[1]);
-    dta.write(startmap.c_str(),startmap.size());
-    for (int i=0; i <14; ++i)
-    {
-      uint64_t nmap = map[i];
-      writebin(nmap, dta, swapit);
-    }
-    dta.write(endmap.c_str(),endmap.size());
+/* Overwrites the entries of a section of fixed width fields. sec holds the
+ * file from <varnames> onwards, the first field starts at start. NA keeps an
+ * entry.
+ */
+static void modifyFields(string &sec, uint64_t start, SEXP x, size_t len,
+                         uint8_t release, const string &what)
+{
+  if (Rf_isNull(x))
+    return;
 
-    dta.close();
-    return 0;
+  for (R_xlen_t i = 0; i < Rf_xlength(x); ++i)
+  {
+    SEXP c = STRING_ELT(x, i);
+    if (c == NA_STRING)
+      continue;
+
+    string val = encodeString(c, release);
+    if (val.size() >= len)
+      throw std::range_error(what + " \"" + val + "\" is too long.");
+    val.resize(len, '\0');
+    memcpy(&sec[start + i * len], val.data(), len);
   }
-  else {
-    throw std::range_error("Unable to open file.");
-    return -1;
+}
+
+/* Rewrites the metadata of an open dta-file and returns by how many bytes the
+ * file has grown. See stataModify().
+ */
+static double modifyDta(FILE * file, List meta)
+{
+  dtaHeader h;
+  dtaReadHeader(file, h);
+  std::vector<uint64_t> map = h.map;
+
+  dtaWriter w;
+  w.release = h.release;
+  w.k = h.k;
+  w.swapit = h.swapit;
+  w.nvarnameslen = h.nvarnameslen;
+  w.nformatslen = h.nformatslen;
+  w.nvalLabelslen = h.nvalLabelslen;
+  w.nvarLabelslen = h.nvarLabelslen;
+  w.chlen = h.chlen;
+  w.lbllen = h.lbllen;
+
+  /* <varnames> up to <data>. Only characteristics may change their size */
+  string sec(map[9] - map[3], '\0');
+  dtaSeek(file, map[3]);
+  if (fread(&sec[0], sec.size(), 1, file) != 1)
+    throw std::range_error("modify: a binary read error occurred");
+
+  modifyFields(sec, 10, meta["names"], w.nvarnameslen, w.release,
+               "Variable name");
+  modifyFields(sec, map[5] - map[3] + 9, meta["formats"], w.nformatslen,
+               w.release, "Format");
+  modifyFields(sec, map[6] - map[3] + 19, meta["vallabels"],
+               w.nvalLabelslen, w.release, "Value label name");
+  modifyFields(sec, map[7] - map[3] + 17, meta["varlabels"],
+               w.nvarLabelslen, w.release, "Variable label");
+
+  SEXP chs = meta["expansion.fields"];
+  if (!Rf_isNull(chs))
+  {
+    StringSink ch;
+    writeCharacteristics(w, ch, chs);
+    sec.resize(map[8] - map[3]);
+    sec += ch.str();
+  }
+
+  /* <value_labels> up to the end of the file */
+  SEXP labeltable = meta["label.table"];
+  StringSink tail;
+  if (!Rf_isNull(labeltable))
+  {
+    const string startvall = "<value_labels>";
+    const string endvall = "</value_labels>";
+    const string end = "</stata_dta>";
+
+    tail.write(startvall.c_str(), startvall.size());
+    writeLabelTable(w, tail, labeltable);
+    tail.write(endvall.c_str(), endvall.size());
+    tail.write(end.c_str(), end.size());
+  }
+
+  /* <data> and <strls> (and unchanged value labels) are moved as they are */
+  int64_t const delta = (int64_t)(map[3] + sec.size()) - (int64_t)map[9];
+  uint64_t const moved = Rf_isNull(labeltable) ? map[13] : map[11];
+  dtaMove(file, map[9], moved, delta);
+
+  for (int i = 9; i < 14; ++i)
+    h.map[i] = map[i] + delta;
+  if (!Rf_isNull(labeltable))
+  {
+    h.map[13] = h.map[11] + tail.str().size();
+    h.map[12] = h.map[13] - 12; // </stata_dta>
+  }
+
+  dtaSeek(file, map[3]);
+  fwrite(sec.data(), sec.size(), 1, file);
+  if (!Rf_isNull(labeltable))
+  {
+    dtaSeek(file, h.map[11]);
+    fwrite(tail.str().data(), tail.str().size(), 1, file);
   }
+  if (ferror(file))
+    throw std::range_error("modify: a write error occurred");
+
+  dtaWriteMap(file, h);
+  if (h.map[13] < map[13])
+    dtaTruncate(file, h.map[13]);
+
+  return (double)h.map[13] - (double)map[13];
+}
+
+// Rewrites the metadata of a dta file in place
+//
+// Fixed width fields are overwritten, characteristics and value labels are
+// replaced. If their size changes, <data> and <strls> are moved in blocks and
+// <map> is patched, observations are never decoded.
+//
+// @param filePath path of an uncompressed dta file.
+// @param meta list of names, formats, vallabels and varlabels (character
+//  vectors, NA keeps an entry), expansion.fields and label.table (NULL keeps
+//  the section).
+// @return number of bytes the file has grown.
+// [[Rcpp::export]]
+double stataModify(const char * filePath, List meta)
+{
+  dtaFile file(filePath, "r+b");
+  if (file == NULL)
+    throw std::range_error("Unable to open file.");
+
+  double const delta = modifyDta(file, meta);
+
+  if (file.close() != 0)
+    throw std::range_error("modify: a write error occurred");
+
+  return delta;
 }
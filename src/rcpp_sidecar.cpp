@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2014-2015 Jan Marvin Garbuszus and Sebastian Jeworutzki
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Rcpp.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "readstata.h"
+
+using namespace Rcpp;
+using namespace std;
+
+/*
+ * Sidecar files keep the variables of a dta-file columnwise as R stores them:
+ * double, int or strings of fixed width. Each column starts at a multiple of
+ * the page size so it can be mapped and used without decoding.
+ *
+ * 1. "DTA13COL" and the format version, padded to a page
+ * 2. the columns
+ * 3. metadata: the serialized attributes of the data.frame
+ * 4. footer: n, k, size, modification time (seconds and nanoseconds) and
+ *    inode of the dta-file and for each column offset, kind and width;
+ *    offset and length of the metadata
+ * 5. offset of the footer and "DTA13COL"
+ *
+ * Sidecar files are a local cache and are written in native byte order.
+ */
+
+#define SIDECAR_MAGIC "DTA13COL"
+
+static const uint32_t sidecarVersion = 2;
+static const uint64_t sidecarPage = 4096;
+
+template <typename T>
+static void writeval(std::fstream& out, T val)
+{
+  out.write((char *)&val, sizeof(val));
+}
+
+static void sidecarPad(std::fstream& out)
+{
+  uint64_t pos = out.tellp();
+  uint64_t pad = (sidecarPage - pos % sidecarPage) % sidecarPage;
+  std::vector<char> zero(pad, 0);
+  if (pad > 0)
+    out.write(&zero[0], pad);
+}
+
+template <typename T>
+static T loadval(FILE * file)
+{
+  T t = 0;
+  if (fread(&t, sizeof(t), 1, file) != 1)
+    Rcpp::warning("sidecar: a binary read error occurred");
+  return t;
+}
+
+// Write a sidecar file
+//
+// @param filePath path of the sidecar file.
+// @param dat data.frame created by stata().
+// @param meta serialized attributes of dat.
+// @param id identity of the dta-file (see stataFileId).
+// @return number of columns written
+// [[Rcpp::export]]
+double stataSidecarWrite(const char * filePath, List dat, RawVector meta,
+                         NumericVector id)
+{
+  /* A sidecar may still be mapped by a data.frame read before. It is not
+   * changed, the new one is written next to it and renamed over it.
+   */
+  std::string const tmpPath = std::string(filePath) + ".tmp";
+  std::fstream out(tmpPath.c_str(), std::ios::out | std::ios::binary);
+  if (!out.is_open())
+    throw std::range_error("Unable to open file.");
+
+  uint32_t const k = dat.size();
+  uint64_t const n = k > 0 ? Rf_xlength(dat[0]) : 0;
+  IntegerVector types = dat.attr("types");
+
+  out.write(SIDECAR_MAGIC, 8);
+  writeval(out, sidecarVersion);
+  sidecarPad(out);
+
+  std::vector<uint64_t> offset(k);
+  std::vector<uint32_t> kind(k), width(k);
+
+  for (uint32_t i = 0; i < k; ++i)
+  {
+    SEXP x = dat[i];
+    offset[i] = out.tellp();
+
+    switch(TYPEOF(x))
+    {
+    case REALSXP:
+      kind[i] = 0;
+      width[i] = sizeof(double);
+      out.write((char *)REAL(x), n * sizeof(double));
+      break;
+    case INTSXP:
+      kind[i] = 1;
+      width[i] = sizeof(int);
+      out.write((char *)INTEGER(x), n * sizeof(int));
+      break;
+    default:
+    {
+      // str# keep their width, strL references are 20 characters
+      int const type = types[i];
+      kind[i] = 2;
+      width[i] = (type == 32768) ? 20 : type;
+
+      std::string val(width[i], '\0');
+      for (uint64_t j = 0; j < n; ++j)
+      {
+        SEXP s = STRING_ELT(x, j);
+        size_t const len = std::min((size_t)LENGTH(s), (size_t)width[i]);
+        std::fill(val.begin(), val.end(), '\0');
+        memcpy(&val[0], CHAR(s), len);
+        out.write(val.c_str(), width[i]);
+      }
+      break;
+    }
+    }
+    sidecarPad(out);
+  }
+
+  uint64_t const metaoffset = out.tellp();
+  out.write((char *)RAW(meta), meta.size());
+
+  uint64_t const footer = out.tellp();
+  writeval(out, n);
+  writeval(out, k);
+  writeval(out, (double)id[0]);
+  writeval(out, (double)id[1]);
+  writeval(out, (double)id[4]);
+  writeval(out, (double)id[2]);
+  for (uint32_t i = 0; i < k; ++i)
+  {
+    writeval(out, offset[i]);
+    writeval(out, kind[i]);
+    writeval(out, width[i]);
+  }
+  writeval(out, metaoffset);
+  writeval(out, (uint64_t)meta.size());
+
+  writeval(out, footer);
+  out.write(SIDECAR_MAGIC, 8);
+
+  out.close();
+  bool failed = out.fail();
+#ifdef _WIN32
+  // rename() does not replace files on Windows, sidecars are not mapped there
+  if (!failed)
+    remove(filePath);
+#endif
+  if (!failed)
+    failed = rename(tmpPath.c_str(), filePath) != 0;
+  if (failed)
+  {
+    remove(tmpPath.c_str());
+    throw std::range_error("sidecar: a write error occurred.");
+  }
+
+  return k;
+}
+
+// Read a sidecar file
+//
+// @param filePath path of the sidecar file.
+// @param id identity of the dta-file (see stataFileId).
+// @return list of columns with attribute meta, NULL if the sidecar does not
+// match the dta-file or is damaged.
+// [[Rcpp::export]]
+SEXP stataSidecarRead(const char * filePath, NumericVector id)
+{
+  struct stat st;
+  if (stat(filePath, &st) != 0 || (uint64_t)st.st_size < 16 + sidecarPage)
+    return R_NilValue;
+  uint64_t const size = st.st_size;
+
+  dtaFile file(filePath, "rb");
+  if (file == NULL)
+    return R_NilValue;
+
+  // check the trailer and the dta-file the sidecar was written for
+  std::string magic(8, '\0');
+  fseek(file, -16, SEEK_END);
+  uint64_t const footer = loadval<uint64_t>(file);
+  readstring(magic, file, 8);
+
+  if (magic != SIDECAR_MAGIC || footer >= size)
+    return R_NilValue;
+
+  dtaSeek(file, 8);
+  uint32_t const version = loadval<uint32_t>(file);
+
+  dtaSeek(file, footer);
+  uint64_t const n = loadval<uint64_t>(file);
+  uint32_t const k = loadval<uint32_t>(file);
+  double const dtasize = loadval<double>(file);
+  double const dtamtime = loadval<double>(file);
+  double const dtansec = loadval<double>(file);
+  double const dtainode = loadval<double>(file);
+
+  if (version != sidecarVersion || dtasize != REAL(id)[0] ||
+      dtamtime != REAL(id)[1] || dtansec != REAL(id)[4] ||
+      dtainode != REAL(id)[2])
+    return R_NilValue;
+
+  // the footer fills the file up to the trailer
+  if (size - 16 < footer + 60 || size - 16 - footer - 60 != 16 * (uint64_t)k)
+    return R_NilValue;
+
+  std::vector<uint64_t> offset(k);
+  std::vector<uint32_t> kind(k), width(k);
+  for (uint32_t i = 0; i < k; ++i)
+  {
+    offset[i] = loadval<uint64_t>(file);
+    kind[i] = loadval<uint32_t>(file);
+    width[i] = loadval<uint32_t>(file);
+  }
+  uint64_t const metaoffset = loadval<uint64_t>(file);
+  uint64_t const metalen = loadval<uint64_t>(file);
+
+  // columns and metadata lie before the footer
+  for (uint32_t i = 0; i < k; ++i)
+  {
+    uint32_t const expect = (kind[i] == 0) ? sizeof(double) :
+      (kind[i] == 1) ? sizeof(int) : width[i];
+    if (kind[i] > 2 || width[i] == 0 || width[i] != expect ||
+        offset[i] > footer || n > (footer - offset[i]) / width[i])
+      return R_NilValue;
+  }
+  if (metaoffset > footer || metalen > footer - metaoffset)
+    return R_NilValue;
+
+  RawVector meta(metalen);
+  dtaSeek(file, metaoffset);
+  if (metalen > 0 && fread(RAW(meta), metalen, 1, file) != 1)
+    Rcpp::warning("sidecar: a binary read error occurred");
+
+  List df(k);
+
+  if (dtaMapAvailable() && dtaLazyAvailable())
+  {
+    // columns are used from the mapped file
+    SEXP map = PROTECT(dtaMapFile(filePath, size));
+    for (uint32_t i = 0; i < k; ++i)
+      SET_VECTOR_ELT(df, i, dtaMappedColumn(map, kind[i], width[i],
+                                            offset[i], n));
+    UNPROTECT(1);
+  } else {
+    // columns are read at once
+    for (uint32_t i = 0; i < k; ++i)
+    {
+      dtaSeek(file, offset[i]);
+      switch(kind[i])
+      {
+      case 0:
+      {
+        NumericVector x(n);
+        if (n > 0 && fread(REAL(x), n * sizeof(double), 1, file) != 1)
+          Rcpp::warning("sidecar: a binary read error occurred");
+        SET_VECTOR_ELT(df, i, x);
+        break;
+      }
+      case 1:
+      {
+        IntegerVector x(n);
+        if (n > 0 && fread(INTEGER(x), n * sizeof(int), 1, file) != 1)
+          Rcpp::warning("sidecar: a binary read error occurred");
+        SET_VECTOR_ELT(df, i, x);
+        break;
+      }
+      default:
+      {
+        CharacterVector x(n);
+        std::string val(width[i], '\0');
+        for (uint64_t j = 0; j < n; ++j)
+        {
+          readstring(val, file, width[i]);
+          SET_STRING_ELT(x, j, dtaStr(&val[0], width[i]));
+        }
+        SET_VECTOR_ELT(df, i, x);
+        break;
+      }
+      }
+    }
+  }
+
+  file.close();
+
+  df.attr("meta") = meta;
+  return df;
+}
@@ -0,0 +1,449 @@
+/*
+ * Copyright (C) 2015 Jan Marvin Garbuszus and Sebastian Jeworutzki
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Rcpp.h>
+#include <string>
+#include <vector>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <stdint.h>
+
+using namespace Rcpp;
+using namespace std;
+
+/*
+ * Stata business calendars (stbcal-files). A calendar is a range of days of
+ * which some are omitted, e.g. weekends and holidays. Business day 0 is the
+ * center date, the days before and after are numbered consecutively.
+ *
+ * Days are counted like R's Date: days since 1970-01-01.
+ */
+
+// days since 1970-01-01 of a civil date (H. Hinnant, days_from_civil)
+static int32_t bcalDays(int32_t y, int32_t m, int32_t d)
+{
+  y -= m <= 2;
+  int32_t const era = (y >= 0 ? y : y - 399) / 400;
+  int32_t const yoe = y - era * 400;
+  int32_t const doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  int32_t const doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+// days of a month, any year is leap year 0 (e.g. for "*feb29")
+static int32_t bcalMonthDays(int32_t y, int32_t m)
+{
+  static const int32_t len[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30,
+                                  31};
+  bool const leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+  return (m == 2 && leap) ? 29 : len[m - 1];
+}
+
+// day of the week, 0 is Sunday. 1970-01-01 was a Thursday.
+static int bcalWeekday(int32_t z)
+{
+  return ((z + 4) % 7 + 7) % 7;
+}
+
+// business days in a word of the calendar bitmap
+static inline int32_t bcalCount(uint64_t v)
+{
+#ifdef __GNUC__
+  return __builtin_popcountll(v);
+#else
+  int32_t cnt = 0;
+  for (; v; ++cnt)
+    v &= v - 1;
+  return cnt;
+#endif
+}
+
+static const char * const bcalWeekdays[7] = {
+  "Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday",
+  "Saturday"
+};
+
+static const char * const bcalMonths[12] = {
+  "jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct",
+  "nov", "dec"
+};
+
+static string bcalLower(string s)
+{
+  for (size_t i = 0; i < s.size(); ++i)
+    s[i] = tolower((unsigned char)s[i]);
+  return s;
+}
+
+// weekday of an abbreviation like "Mo" or "monday", -1 if unknown
+static int bcalWeekdayOf(const string &s)
+{
+  string const l = bcalLower(s);
+  for (int i = 0; i < 7; ++i)
+    if (l.size() >= 2 && bcalLower(bcalWeekdays[i]).compare(0, 2, l, 0, 2) == 0)
+      return i;
+  return -1;
+}
+
+// month of a name like "jan" or "January", 0 if unknown
+static int bcalMonthOf(const string &s)
+{
+  string const l = bcalLower(s);
+  for (int i = 0; i < 12; ++i)
+    if (l.size() >= 3 && l.compare(0, 3, bcalMonths[i]) == 0)
+      return i + 1;
+  return 0;
+}
+
+/* A date as written in the stbcal-file in the order of the dateformat, e.g.
+ * "2001jan02" for ymd. The year may be "*" for every year, then year is 0.
+ */
+struct bcalDate
+{
+  int32_t year, month, day;
+};
+
+static bcalDate bcalParseDate(const string &s, const string &format)
+{
+  // separators are optional
+  string t;
+  for (size_t i = 0; i < s.size(); ++i)
+    if (isalnum((unsigned char)s[i]) || s[i] == '*')
+      t += s[i];
+
+  bcalDate d = {0, 0, 0};
+  size_t pos = 0;
+  for (size_t f = 0; f < format.size(); ++f)
+  {
+    size_t digits = 0;
+    while (pos + digits < t.size() && isdigit((unsigned char)t[pos + digits]))
+      ++digits;
+
+    switch (format[f])
+    {
+    case 'y':
+      if (pos < t.size() && t[pos] == '*')
+      {
+        ++pos;
+        break;
+      }
+      if (digits < 4)
+        throw std::range_error("Invalid date in stbcal-file: " + s);
+      d.year = atoi(t.substr(pos, 4).c_str());
+      pos += 4;
+      break;
+    case 'm':
+      if (digits == 0)
+      {
+        size_t letters = 0;
+        while (pos + letters < t.size() && isalpha((unsigned char)t[pos + letters]))
+          ++letters;
+        d.month = bcalMonthOf(t.substr(pos, letters));
+        pos += letters;
+      } else {
+        size_t const n = digits > 2 ? 2 : digits;
+        d.month = atoi(t.substr(pos, n).c_str());
+        pos += n;
+      }
+      break;
+    case 'd':
+    {
+      // a year may follow without separator
+      size_t n = digits > 2 ? 2 : digits;
+      if (f + 1 < format.size() && format[f + 1] == 'y' && digits > 4)
+        n = digits - 4;
+      d.day = atoi(t.substr(pos, n).c_str());
+      pos += n;
+      break;
+    }
+    }
+  }
+
+  if (d.month < 1 || d.month > 12 || d.day < 1 ||
+      d.day > bcalMonthDays(d.year, d.month) || pos != t.size())
+    throw std::range_error("Invalid date in stbcal-file: " + s);
+  return d;
+}
+
+// days of a date in the years [first, last] that have it (e.g. feb29)
+static void bcalDaysOf(const bcalDate &d, int32_t first, int32_t last,
+                       std::vector<int32_t> &days)
+{
+  if (d.year != 0)
+  {
+    days.push_back(bcalDays(d.year, d.month, d.day));
+    return;
+  }
+  for (int32_t y = first; y <= last; ++y)
+    if (d.day <= bcalMonthDays(y, d.month))
+      days.push_back(bcalDays(y, d.month, d.day));
+}
+
+// words of a line, parentheses removed
+static std::vector<string> bcalWords(const string &line)
+{
+  std::vector<string> words;
+  string w;
+  for (size_t i = 0; i <= line.size(); ++i)
+  {
+    char const c = i < line.size() ? line[i] : ' ';
+    if (isspace((unsigned char)c) || c == '(' || c == ')')
+    {
+      if (!w.empty())
+        words.push_back(w);
+      w.clear();
+    } else {
+      w += c;
+    }
+  }
+  return words;
+}
+
+// Parses a Stata business calendar
+//
+// @param lines character vector of the lines of a stbcal-file
+// @return list of the business days (days since 1970-01-01), their weekdays,
+// the business day of the first and the purpose line
+// [[Rcpp::export]]
+List stataBcal(CharacterVector lines)
+{
+  string format = "ymd", purpose;
+  std::vector<string> rangeWords, centerWords;
+  std::vector<int> omitWeekday(7, 0);
+
+  // omitted dates are collected first, the range may follow them
+  std::vector<string> omitDates;
+  std::vector< std::vector<string> > omitDowinmonth;
+  bool conditions = false;
+
+  for (R_xlen_t i = 0; i < lines.size(); ++i)
+  {
+    string const line = as<string>(lines[i]);
+    std::vector<string> const w = bcalWords(line);
+    if (w.empty() || w[0][0] == '*')
+      continue;
+
+    if (w[0] == "purpose")
+      purpose = line;
+    else if (w[0] == "dateformat" && w.size() > 1)
+      format = w[1];
+    else if (w[0] == "range" && w.size() > 2)
+      rangeWords.assign(w.begin() + 1, w.begin() + 3);
+    else if (w[0] == "centerdate" && w.size() > 1)
+      centerWords.assign(w.begin() + 1, w.end());
+    else if (w[0] == "omit" && w.size() > 2)
+    {
+      size_t end = w.size();
+      for (size_t j = 2; j < w.size(); ++j)
+        if (w[j] == "and" || w[j] == "if")
+        {
+          end = j;
+          conditions = true;
+          break;
+        }
+
+      if (w[1] == "dayofweek")
+      {
+        for (size_t j = 2; j < end; ++j)
+        {
+          int const wd = bcalWeekdayOf(w[j]);
+          if (wd >= 0)
+            omitWeekday[wd] = 1;
+        }
+      }
+      else if (w[1] == "date")
+      {
+        string d;
+        for (size_t j = 2; j < end; ++j)
+          d += w[j];
+        omitDates.push_back(d);
+      }
+      else if (w[1] == "dowinmonth" && end >= 6)
+      {
+        // omit dowinmonth +3 Th of nov: the third Thursday of November
+        omitDowinmonth.push_back(std::vector<string>(w.begin() + 2,
+                                                     w.begin() + end));
+      }
+    }
+  }
+
+  if (conditions)
+    Rcpp::warning("Conditions of omitted days (and, if) are not supported and ignored.");
+
+  if (format.size() != 3 || format.find('y') == string::npos ||
+      format.find('m') == string::npos || format.find('d') == string::npos)
+    throw std::range_error("Invalid dateformat in stbcal-file: " + format);
+  if (rangeWords.size() != 2)
+    throw std::range_error("stbcal-file has no range.");
+
+  bcalDate const rs = bcalParseDate(rangeWords[0], format);
+  bcalDate const re = bcalParseDate(rangeWords[1], format);
+  int32_t const start = bcalDays(rs.year, rs.month, rs.day);
+  int32_t const stop = bcalDays(re.year, re.month, re.day);
+  if (rs.year == 0 || re.year == 0 || stop < start)
+    throw std::range_error("Invalid range in stbcal-file.");
+
+  int32_t center = start;
+  if (!centerWords.empty())
+  {
+    string c;
+    for (size_t j = 0; j < centerWords.size(); ++j)
+      c += centerWords[j];
+    bcalDate const cd = bcalParseDate(c, format);
+    center = bcalDays(cd.year, cd.month, cd.day);
+  }
+
+  // valid days of the range
+  int32_t const ndays = stop - start + 1;
+  std::vector<char> valid(ndays, 1);
+  for (int32_t z = start; z <= stop; ++z)
+    if (omitWeekday[bcalWeekday(z)])
+      valid[z - start] = 0;
+
+  std::vector<int32_t> omitted;
+  for (size_t j = 0; j < omitDates.size(); ++j)
+    bcalDaysOf(bcalParseDate(omitDates[j], format), rs.year, re.year,
+               omitted);
+
+  for (size_t j = 0; j < omitDowinmonth.size(); ++j)
+  {
+    const std::vector<string> &r = omitDowinmonth[j];
+    int const nth = atoi(r[0].c_str());
+    int const wd = bcalWeekdayOf(r[1]);
+    int const month = bcalMonthOf(r[3]);
+    if (nth == 0 || wd < 0 || month == 0)
+      throw std::range_error("Invalid dowinmonth in stbcal-file.");
+
+    for (int32_t y = rs.year; y <= re.year; ++y)
+    {
+      // +n counts from the first day of the month, -n from the last
+      int32_t z;
+      if (nth > 0)
+      {
+        z = bcalDays(y, month, 1);
+        z += (wd - bcalWeekday(z) + 7) % 7 + 7 * (nth - 1);
+      } else {
+        z = bcalDays(month == 12 ? y + 1 : y, month == 12 ? 1 : month + 1, 1) - 1;
+        z -= (bcalWeekday(z) - wd + 7) % 7 + 7 * (-nth - 1);
+      }
+      omitted.push_back(z);
+    }
+  }
+
+  for (size_t j = 0; j < omitted.size(); ++j)
+    if (omitted[j] >= start && omitted[j] <= stop)
+      valid[omitted[j] - start] = 0;
+
+  // business days and the number of business days before the center
+  std::vector<int32_t> days;
+  int32_t before = 0;
+  for (int32_t z = start; z <= stop; ++z)
+  {
+    if (!valid[z - start])
+      continue;
+    days.push_back(z);
+    if (z < center)
+      ++before;
+  }
+
+  IntegerVector range(days.begin(), days.end());
+  CharacterVector daysofweek(days.size());
+  for (size_t j = 0; j < days.size(); ++j)
+    daysofweek[j] = bcalWeekdays[bcalWeekday(days[j])];
+
+  List res(4);
+  res[0] = range;
+  res[1] = daysofweek;
+  res[2] = -before;
+  res[3] = purpose.empty() ? R_NilValue : wrap(purpose);
+  res.attr("names") = CharacterVector::create("range", "daysofweek", "first",
+                                              "purpose");
+  return res;
+}
+
+// Dates of business days
+//
+// @param x business days
+// @param days dates of the business days of a calendar (days since 1970-01-01)
+// @param first business day of the first date in days
+// @return dates as days since 1970-01-01, NA outside of the calendar
+// [[Rcpp::export]]
+IntegerVector stataBcalDate(NumericVector x, IntegerVector days, int first)
+{
+  R_xlen_t const n = x.size(), nd = days.size();
+  IntegerVector res = IntegerVector(no_init(n));
+  const int * d = INTEGER(days);
+  const double * b = REAL(x);
+  int * r = INTEGER(res);
+
+  for (R_xlen_t i = 0; i < n; ++i)
+  {
+    double const pos = b[i] - first;
+    r[i] = (pos >= 0 && pos < nd && pos == floor(pos)) ? d[(R_xlen_t)pos] :
+      NA_INTEGER;
+  }
+  return res;
+}
+
+// Business days of dates
+//
+// The calendar becomes a bitmap of its days with the number of business days
+// before each word of 64 days, so each date is looked up in constant time.
+//
+// @param x dates as days since 1970-01-01
+// @param days dates of the business days of a calendar (days since 1970-01-01)
+// @param first business day of the first date in days
+// @return business days, NA for omitted days and outside of the calendar
+// [[Rcpp::export]]
+NumericVector stataBcalDay(NumericVector x, IntegerVector days, int first)
+{
+  R_xlen_t const n = x.size(), nd = days.size();
+  NumericVector res = NumericVector(no_init(n));
+
+  int32_t const start = nd > 0 ? days[0] : 0;
+  int32_t const ndays = nd > 0 ? days[nd - 1] - start + 1 : 0;
+  std::vector<uint64_t> bits((ndays + 63) / 64, 0);
+  std::vector<int32_t> before(bits.size(), 0);
+
+  for (R_xlen_t j = 0; j < nd; ++j)
+  {
+    int32_t const z = days[j] - start;
+    bits[z / 64] |= (uint64_t)1 << (z % 64);
+  }
+  for (size_t w = 1; w < bits.size(); ++w)
+    before[w] = before[w - 1] + bcalCount(bits[w - 1]);
+
+  const double * dx = REAL(x);
+  double * r = REAL(res);
+  for (R_xlen_t i = 0; i < n; ++i)
+  {
+    double const pos = dx[i] - start;
+    r[i] = NA_REAL;
+    if (!(pos >= 0 && pos < ndays))
+      continue;
+
+    int32_t const z = (int32_t)pos;
+    uint64_t const word = bits[z / 64];
+    uint64_t const bit = (uint64_t)1 << (z % 64);
+    if (!(word & bit))
+      continue;
+
+    r[i] = first + before[z / 64] + bcalCount(word & (bit - 1));
+  }
+  return res;
+}
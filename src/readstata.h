@@ -0,0 +1,302 @@
+#ifndef READSTATA
+#define READSTATA
+
+#include <Rcpp.h>
+#include <algorithm>
+#include <string>
+#include <stdint.h>
+#include "dtacore.h"
+
+/* Test for a little-endian machine */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define lsf "LSF"
+#else
+#define lsf "MSF"
+#endif
+
+template <typename T>
+static T readbin( T t , FILE * file, bool swapit)
+{
+  dtaProf.io(sizeof(t));
+  if (fread(&t, sizeof(t), 1, file) != 1)
+    Rcpp::warning("num: a binary read error occurred");
+  if (swapit==0)
+    return(t);
+  else
+    return(swap_endian(t));
+}
+
+static inline void readstring(std::string &mystring, FILE * fp, int nchar)
+{
+  dtaProf.io(nchar);
+  if (!fread(&mystring[0], nchar, 1, fp))
+    Rcpp::warning("char: a binary read error occurred");
+}
+
+/* fseek to an absolute position. Files may be larger than a long. */
+static inline int dtaSeek(FILE * file, uint64_t pos)
+{
+  dtaProf.seek();
+#ifdef _WIN32
+  return _fseeki64(file, pos, SEEK_SET);
+#else
+  return fseeko(file, pos, SEEK_SET);
+#endif
+}
+
+/* skip n bytes */
+static inline int dtaSkip(FILE * file, uint64_t n)
+{
+  dtaProf.seek();
+#ifdef _WIN32
+  return _fseeki64(file, n, SEEK_CUR);
+#else
+  return fseeko(file, n, SEEK_CUR);
+#endif
+}
+
+/* TRUE if options(readstata13.profile = TRUE) asks for a profile of stata()
+ * and stataWrite(), see dtaprofile.h
+ */
+static inline bool dtaProfileOption()
+{
+  return Rf_asLogical(Rf_GetOption1(Rf_install("readstata13.profile"))) == TRUE;
+}
+
+/* Interruption and progress of long loops. add() is called with the bytes
+ * done so far in blocks. About every MB it checks for a user interrupt, which
+ * is thrown as exception so files are closed by their destructors. Every
+ * options(readstata13.progress.every) bytes (default 64MB) it reports the
+ * progress if options(readstata13.progress) is TRUE or a function called
+ * with the phase, the bytes done and the total bytes. Without a phase only
+ * interrupts are checked.
+ */
+class dtaProgress
+{
+public:
+  dtaProgress(const char * phase, uint64_t total) : phase(phase),
+  total(total), done(0), pending(0), next(0), every(0), report(R_NilValue)
+  {
+    SEXP opt = Rf_GetOption1(Rf_install("readstata13.progress"));
+    if (phase != NULL && (Rf_isFunction(opt) || Rf_asLogical(opt) == TRUE))
+    {
+      report = opt;
+      SEXP ev = Rf_GetOption1(Rf_install("readstata13.progress.every"));
+      every = Rf_isNull(ev) ? (1 << 26) : Rf_asReal(ev);
+      if (!(every >= 1))
+        every = 1;
+      next = every;
+    }
+  }
+
+  void add(uint64_t n)
+  {
+    done += n;
+    pending += n;
+    if (pending >= (1 << 20))
+      step();
+  }
+
+  /* reports 100% of a phase that was reported before */
+  void finish()
+  {
+    if (!Rf_isNull(report) && next > every)
+    {
+      done = total;
+      show();
+    }
+  }
+
+private:
+  void step()
+  {
+    pending = 0;
+    Rcpp::checkUserInterrupt();
+    if (!Rf_isNull(report) && done >= next)
+    {
+      show();
+      next = done + every;
+    }
+  }
+
+  void show()
+  {
+    if (Rf_isFunction(report))
+    {
+      Rcpp::Function f(report);
+      f(phase, (double)done, (double)total);
+    } else {
+      REprintf("%s: %.0f%%\n", phase,
+               total > 0 ? 100.0 * done / total : 100.0);
+    }
+  }
+
+  const char * phase;
+  uint64_t total, done, pending;
+  double next, every;
+  SEXP report;
+};
+
+/* Entries of <characteristics>, <strls> and <value_labels> collected for R.
+ * Rcpp's push_back and push_front copy the list on every call, here the
+ * capacity doubles when it is full. It starts with the most entries the size
+ * of the section allows, at most 65536. get() returns the entries in file
+ * order or reversed (like repeated push_front).
+ */
+class dtaList
+{
+public:
+  dtaList(uint64_t most) : n(0)
+  {
+    x = Rcpp::List(std::max<uint64_t>(std::min<uint64_t>(most, 65536), 16));
+  }
+
+  // v is protected by the caller
+  void add(SEXP v)
+  {
+    if (n == x.size())
+      x = Rf_xlengthgets(x, 2 * n);
+    SET_VECTOR_ELT(x, n++, v);
+  }
+
+  void add(SEXP v, const std::string &name)
+  {
+    if (n == x.size())
+      x = Rf_xlengthgets(x, 2 * n);
+    if (names.size() < x.size())
+      names = Rf_xlengthgets(names, x.size());
+    SET_STRING_ELT(names, n, Rf_mkChar(name.c_str()));
+    SET_VECTOR_ELT(x, n++, v);
+  }
+
+  Rcpp::List get(bool reversed)
+  {
+    Rcpp::List res(n);
+    for (R_xlen_t i = 0; i < n; ++i)
+      SET_VECTOR_ELT(res, i, VECTOR_ELT(x, reversed ? n - 1 - i : i));
+    if (names.size() > 0)
+    {
+      Rcpp::CharacterVector nm(n);
+      for (R_xlen_t i = 0; i < n; ++i)
+        SET_STRING_ELT(nm, i, STRING_ELT(names, reversed ? n - 1 - i : i));
+      res.attr("names") = nm;
+    }
+    return res;
+  }
+
+private:
+  Rcpp::List x;
+  Rcpp::CharacterVector names;
+  R_xlen_t n;
+};
+
+/* Decoding of a single value in <data> as R value (see dtacore.h). Used by
+ * stata() and the lazy columns (rcpp_altrep.cpp).
+ */
+
+// double
+static inline double dtaDouble(const char * p, bool swapit, bool missing)
+{
+  double val_d = loadbin<double>(p, swapit);
+
+  if ((missing == 0) & !(val_d == R_NegInf) & ((val_d<STATA_DOUBLE_NA_MIN) | (val_d>STATA_DOUBLE_NA_MAX)) )
+    return NA_REAL;
+  return val_d;
+}
+
+// float
+static inline double dtaFloat(const char * p, bool swapit, bool missing)
+{
+  float val_f = loadbin<float>(p, swapit);
+
+  if ((missing == 0) & ((val_f<STATA_FLOAT_NA_MIN) | (val_f>STATA_FLOAT_NA_MAX)) )
+    return NA_REAL;
+  return val_f;
+}
+
+// long
+static inline int dtaLong(const char * p, bool swapit, bool missing)
+{
+  int32_t val_l = loadbin<int32_t>(p, swapit);
+
+  if ((missing == 0) & ((val_l<STATA_INT_NA_MIN) | (val_l>STATA_INT_NA_MAX)) )
+    return NA_INTEGER;
+  return val_l;
+}
+
+// int
+static inline int dtaInt(const char * p, bool swapit, bool missing)
+{
+  int16_t val_i = loadbin<int16_t>(p, swapit);
+
+  if ((missing == 0) & ((val_i<STATA_SHORTINT_NA_MIN) | (val_i>STATA_SHORTINT_NA_MAX)) )
+    return NA_INTEGER;
+  return val_i;
+}
+
+// byte
+static inline int dtaByte(const char * p, bool swapit, bool missing)
+{
+  int8_t val_b = *p;
+
+  if ((missing == 0) & ( (val_b<STATA_BYTE_NA_MIN) | (val_b>STATA_BYTE_NA_MAX)) )
+    return NA_INTEGER;
+  return val_b;
+}
+
+// strings with 2045 or fewer characters. Strings end at the first binary 0.
+static inline SEXP dtaStr(const char * p, int32_t len)
+{
+  int32_t nchar = 0;
+  while (nchar < len && p[nchar] != '\0')
+    ++nchar;
+  return Rf_mkCharLen(p, nchar);
+}
+
+/* reference to a strL as R knows it: v and o with 10 digits each. The same
+ * key is given to the strL in attribute strl.
+ */
+static inline void dtaStrlKey(char * key, size_t size, uint64_t ref,
+                              uint8_t release)
+{
+  snprintf(key, size, "%010llu%010llu",
+           (unsigned long long)dtaStrlV(ref, release),
+           (unsigned long long)dtaStrlO(ref, release));
+}
+
+// reference to a strL at p in <data>
+static inline SEXP dtaStrl(const char * p, uint8_t release, bool swapit)
+{
+  char val_strl[42];
+  dtaStrlKey(val_strl, sizeof val_strl, dtaLoadStrl(p, release, swapit),
+             release);
+  return Rf_mkChar(val_strl);
+}
+
+/* Bytes of a string as written to a file of release: CP1252 for 117 (other
+ * characters as <xx>), UTF-8 for newer releases. See rcpp_savestata.cpp.
+ */
+void encodeString(SEXP c, uint8_t release, std::string &out);
+
+/* Lazy columns (rcpp_altrep.cpp). The data of the file starts at offset, a
+ * variable is found at coloff within each observation of rowlen bytes.
+ */
+bool dtaLazyAvailable();
+SEXP dtaLazyFile(const char * filePath, uint64_t offset, uint64_t rowlen,
+                 uint64_t n, uint8_t release, bool swapit, bool missing);
+SEXP dtaLazyColumn(SEXP lazyfile, int32_t vartype, uint64_t coloff);
+
+/* Strings stored in raw, dtaWidth(vartype) bytes per value. strL references
+ * are stored as in a file of release.
+ */
+SEXP dtaCompactString(SEXP raw, int32_t vartype, uint8_t release, bool swapit);
+
+/* Columns of a memory mapped sidecar file (rcpp_sidecar.cpp). kind is 0 for
+ * double, 1 for integer and 2 for strings of width bytes.
+ */
+bool dtaMapAvailable();
+SEXP dtaMapFile(const char * filePath, uint64_t size);
+SEXP dtaMappedColumn(SEXP map, int32_t kind, int32_t width, uint64_t offset,
+                     uint64_t n);
+
+#endif
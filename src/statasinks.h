@@ -0,0 +1,112 @@
+#ifndef STATASINKS
+#define STATASINKS
+
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <stdint.h>
+#include <zlib.h>
+#include "dtaprofile.h"
+
+/* Sinks the dta writer can write to. Every sink provides write() and tell().
+ * Only FileSink is able to seek, all other sinks are written forward-only.
+ */
+
+/* uncompressed file */
+class FileSink
+{
+public:
+  bool open(const char * filePath)
+  {
+    dta.open(filePath, std::ios::out | std::ios::binary);
+    return dta.is_open();
+  }
+  bool is_open() { return dta.is_open(); }
+  void write(const char * s, uint64_t n)
+  {
+    dtaProf.io(n);
+    dta.write(s, n);
+  }
+  uint64_t tell() { return dta.tellp(); }
+  void seek(uint64_t pos)
+  {
+    dtaProf.seek();
+    dta.seekp(pos);
+  }
+  void close() { dta.close(); }
+
+private:
+  std::fstream dta;
+};
+
+/* gzip compressed file */
+class GzSink
+{
+public:
+  GzSink() : gz(NULL), pos(0) {}
+  ~GzSink() { if (gz != NULL) gzclose(gz); }
+
+  bool open(const char * filePath)
+  {
+    gz = gzopen(filePath, "wb6");
+    if (gz != NULL)
+      gzbuffer(gz, 1 << 17);
+    return gz != NULL;
+  }
+  bool is_open() { return gz != NULL; }
+  void write(const char * s, uint64_t n)
+  {
+    // gzwrite takes an unsigned int length
+    while (n > 0)
+    {
+      unsigned int len = n > (1U << 30) ? (1U << 30) : (unsigned int)n;
+      dtaProf.io(len);
+      if (gzwrite(gz, s, len) != (int)len)
+        throw std::range_error("gzip: a write error occurred.");
+      s += len;
+      n -= len;
+      pos += len;
+    }
+  }
+  uint64_t tell() { return pos; }
+  void close()
+  {
+    if (gz != NULL && gzclose(gz) != Z_OK)
+    {
+      gz = NULL;
+      throw std::range_error("gzip: unable to close file.");
+    }
+    gz = NULL;
+  }
+
+private:
+  gzFile gz;
+  uint64_t pos;
+};
+
+/* counts the bytes written. Used to compute the <map> ahead of writing */
+class CountSink
+{
+public:
+  CountSink() : pos(0) {}
+  void write(const char *, uint64_t n) { pos += n; }
+  void skip(uint64_t n) { pos += n; }
+  uint64_t tell() { return pos; }
+
+private:
+  uint64_t pos;
+};
+
+/* bytes in memory. Used for sections rewritten in an existing file */
+class StringSink
+{
+public:
+  void write(const char * s, uint64_t n) { buf.append(s, n); }
+  uint64_t tell() { return buf.size(); }
+  const std::string &str() const { return buf; }
+
+private:
+  std::string buf;
+};
+
+#endif